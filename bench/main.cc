@@ -0,0 +1,481 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "crc/crc.h"
+#include "log/log.h"
+#include "master.h"
+#include "protocol/codec.h"
+#include "protocol/frame.h"
+#include "protocol/layer.h"
+#include "protocol/memory.h"
+
+/* Microbenchmarks of the stages of the link. Each benchmark is warmed up, then timed in samples of
+   enough iterations to last the minimum time, and the samples are summarized per frame and per byte.
+   A filter runs the benchmarks whose names contain it, so that one stage can be profiled alone:
+       perf record -g ./serial_bench --repetitions=50 crc16
+   The heap allocations of the samples are counted as well. The benchmarks of a link running on arenas
+   must not allocate once they are warmed up, the bench fails if they do. */
+
+/* operator new and delete counting the allocations, the arrays and nothrow forms call these */
+static std::atomic<int64_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations++;
+    void* block = malloc(size ? size : 1);
+    if (block == NULL) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+#if defined(__GNUC__)
+template <typename T>
+inline void DoNotOptimize(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+#else
+template <typename T>
+inline void DoNotOptimize(T const& value) {
+    static volatile T sink;
+    sink = value;
+}
+#endif
+
+struct BenchOptions {
+    std::string filter;
+    int repetitions;
+    int min_time;  // time of a sample in ms
+    int warmup;    // time of warmup in ms
+};
+
+static BenchOptions options = {"", 10, 20, 50};
+
+static double Now() {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// @brief Check if the benchmark is chosen by the filter
+static bool Selected(const std::string& name) {
+    return name.find(options.filter) != std::string::npos;
+}
+
+/// @brief Time the body and print the summary of samples
+/// @param name name of benchmark
+/// @param frames frames handled by one iteration
+/// @param bytes bytes handled by one iteration
+/// @param body one iteration
+/// @return heap allocations per frame, -1 if the benchmark is not chosen
+static double Bench(const std::string& name, int frames, int64_t bytes, std::function<void()> body) {
+    if (!Selected(name)) {
+        return -1;
+    }
+
+    // warm up the caches and branch predictors, then size the samples from the pace seen
+    int64_t iterations = 0;
+    double begin = Now();
+    double elapsed = 0;
+    while (elapsed < options.warmup * 1e6) {
+        body();
+        iterations++;
+        elapsed = Now() - begin;
+    }
+    int64_t per_sample = (int64_t)ceil(iterations * options.min_time * 1e6 / elapsed);
+
+    std::vector<double> samples;  // ns per iteration
+    samples.reserve(options.repetitions);
+    int64_t allocated = allocations;
+    for (int r = 0; r < options.repetitions; r++) {
+        double start = Now();
+        for (int64_t i = 0; i < per_sample; i++) {
+            body();
+        }
+        samples.push_back((Now() - start) / per_sample);
+    }
+    double allocs = (double)(allocations - allocated) / ((double)per_sample * options.repetitions * frames);
+
+    std::sort(samples.begin(), samples.end());
+    double mean = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        mean += samples[i];
+    }
+    mean /= samples.size();
+    double variance = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        variance += (samples[i] - mean) * (samples[i] - mean);
+    }
+    double stddev = samples.size() > 1 ? sqrt(variance / (samples.size() - 1)) : 0;
+    double median = samples[samples.size() / 2];
+    if (samples.size() % 2 == 0) {
+        median = (median + samples[samples.size() / 2 - 1]) / 2;
+    }
+
+    printf("%-32s %12.1f %12.1f %10.3f %10.3f %10.3f %7.2f%% %9.1f %8.2f\n", name.c_str(), median / frames, samples[0] / frames,
+           median / bytes, samples[0] / bytes, samples.back() / bytes, mean > 0 ? stddev * 100 / mean : 0, bytes * 1e3 / median,
+           allocs);
+    return allocs;
+}
+
+/// @brief A serial replaying the bytes filled, so that the layer is fed without system calls
+class LoopbackPort : public raw::SerialPortBase {
+   public:
+    LoopbackPort() : SerialPortBase("loopback", 0, 8, 'N', 1), pos_(0), repeat_(false), written_(0) { ; }
+
+    /// @param stream the bytes to be read
+    /// @param repeat whether the bytes start over when they are read, else reads fail after them
+    void Fill(const std::vector<uint8_t>& stream, bool repeat) {
+        stream_ = stream;
+        pos_ = 0;
+        repeat_ = repeat;
+    }
+
+    bool Drained() { return !repeat_ && pos_ >= stream_.size(); }
+
+    virtual bool Open() { return is_open_ = true; }
+
+    virtual void Close() { is_open_ = false; }
+
+    virtual void Discard() { ; }
+
+    virtual int ReadByte() {
+        uint8_t byte;
+        return Read(&byte, 1) == 1 ? byte : -1;
+    }
+
+    virtual int Read(uint8_t* buffer, int length) {
+        if (pos_ >= stream_.size() && repeat_) {
+            pos_ = 0;
+        }
+        int bytes = (int)std::min((size_t)length, stream_.size() - pos_);
+        if (bytes <= 0) {
+            return -1;
+        }
+        memcpy(buffer, stream_.data() + pos_, bytes);
+        pos_ += bytes;
+        return bytes;
+    }
+
+    virtual int Write(uint8_t* /* buffer */, int length) {
+        written_ += length;
+        return length;
+    }
+
+    virtual void SetTimeout(int /* timeout */) { ; }
+
+   private:
+    std::vector<uint8_t> stream_;
+    size_t pos_;
+    bool repeat_;
+    uint64_t written_;
+};
+
+/// @brief One direction of an in-memory line between two serials
+/// NOTE: The bytes are kept in a ring of fixed size, so that the line allocates nothing as it runs.
+struct Pipe {
+    Pipe() : ring(1 << 20), head(0), count(0) { ; }
+
+    std::mutex mutex;
+    std::condition_variable readable;
+    std::condition_variable writable;
+    std::vector<uint8_t> ring;
+    size_t head;   // first byte not yet read
+    size_t count;  // bytes not yet read
+};
+
+class PipePort : public raw::SerialPortBase {
+   public:
+    PipePort(Pipe* rx, Pipe* tx) : SerialPortBase("pipe", 0, 8, 'N', 1), rx_(rx), tx_(tx), timeout_(10) { ; }
+
+    virtual bool Open() { return is_open_ = true; }
+
+    virtual void Close() { is_open_ = false; }
+
+    virtual void Discard() { ; }
+
+    virtual int ReadByte() {
+        uint8_t byte;
+        return Read(&byte, 1) == 1 ? byte : -1;
+    }
+
+    virtual int Read(uint8_t* buffer, int length) {
+        std::unique_lock<std::mutex> lock(rx_->mutex);
+        if (!rx_->readable.wait_for(lock, std::chrono::milliseconds(timeout_), [this] { return rx_->count > 0; })) {
+            return -1;
+        }
+        int bytes = (int)std::min((size_t)length, rx_->count);
+        for (int i = 0; i < bytes; i++) {
+            buffer[i] = rx_->ring[(rx_->head + i) % rx_->ring.size()];
+        }
+        rx_->head = (rx_->head + bytes) % rx_->ring.size();
+        rx_->count -= bytes;
+        rx_->writable.notify_one();
+        return bytes;
+    }
+
+    virtual int Write(uint8_t* buffer, int length) {
+        {
+            // a full line holds the writer as a serial does
+            std::unique_lock<std::mutex> lock(tx_->mutex);
+            tx_->writable.wait(lock, [&] { return tx_->ring.size() - tx_->count >= (size_t)length; });
+            for (int i = 0; i < length; i++) {
+                tx_->ring[(tx_->head + tx_->count + i) % tx_->ring.size()] = buffer[i];
+            }
+            tx_->count += length;
+        }
+        tx_->readable.notify_one();
+        return length;
+    }
+
+    virtual void SetTimeout(int timeout) { timeout_ = timeout; }
+
+   private:
+    Pipe* rx_;
+    Pipe* tx_;
+    int timeout_;
+};
+
+static std::vector<uint8_t> Payload(int size) {
+    std::vector<uint8_t> data(size);
+    for (int i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    return data;
+}
+
+/// @brief Encode and seal an i-frame as sended on the line, with the cBmark before it
+static std::vector<uint8_t> WireIFrame(int size, uint16_t frame_no) {
+    std::vector<uint8_t> data = Payload(size);
+    std::vector<uint8_t> frame(1 + size + protocol::cIFixedLength);
+    frame[0] = protocol::cBmark;
+    int len = protocol::IFrameCodec<protocol::cImark>::Encode(data.data(), size, false, 0, 0, frame.data() + 1);
+    protocol::IFrameCodec<protocol::cImark>::Seal(frame.data() + 1, len, frame_no);
+    return frame;
+}
+
+static void BenchCrc() {
+    const int lengths[] = {16, 64, 256, 1024, 4096};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        int length = lengths[i];
+        std::vector<uint8_t> data = Payload(length);
+        std::string suffix = "/" + std::to_string(length);
+        Bench("crc/crc8" + suffix, 1, length, [&] { DoNotOptimize(crc::crc8(data.data(), length)); });
+        Bench("crc/crc16" + suffix, 1, length, [&] { DoNotOptimize(crc::crc16(data.data(), length)); });
+        Bench("crc/crc32c" + suffix, 1, length, [&] { DoNotOptimize(crc::crc32c(data.data(), length)); });
+    }
+}
+
+static void BenchCodec() {
+    const int sizes[] = {16, 256, 1024, 4096};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int size = sizes[i];
+        std::vector<uint8_t> data = Payload(size);
+        std::vector<uint8_t> frame(size + protocol::cXFlagsLength + protocol::cXAckLength + protocol::IFrameFixedLength(protocol::cWmark));
+        std::string suffix = "/" + std::to_string(size);
+
+        Bench("frame/prepare_iframe" + suffix, 1, size, [&] {
+            DoNotOptimize(protocol::Frame::PrepareIFrame(data.data(), size, frame.data(), 0));
+        });
+        Bench("frame/prepare_wide_iframe" + suffix, 1, size, [&] {
+            DoNotOptimize(protocol::Frame::PrepareIFrame(data.data(), size, frame.data(), protocol::IFRAME_CRC32C));
+        });
+
+        // the checksum is filled when the frame is sended and checked as it is received
+        int len = protocol::Frame::PrepareIFrame(data.data(), size, frame.data(), 0);
+        Bench("codec/seal_iframe" + suffix, 1, size, [&] {
+            protocol::IFrameCodec<protocol::cImark>::Seal(frame.data(), len, 1);
+            DoNotOptimize(frame[len - 2]);
+        });
+        Bench("codec/parse_iframe" + suffix, 1, size, [&] {
+            DoNotOptimize(protocol::IFrameCodec<protocol::cImark>::Parse(frame.data(), len));
+        });
+        int wide = protocol::Frame::PrepareIFrame(data.data(), size, frame.data(), protocol::IFRAME_CRC32C);
+        protocol::IFrameCodec<protocol::cWmark>::Seal(frame.data(), wide, 1);
+        Bench("codec/parse_wide_iframe" + suffix, 1, size, [&] {
+            DoNotOptimize(protocol::IFrameCodec<protocol::cWmark>::Parse(frame.data(), wide));
+        });
+    }
+}
+
+static void CountFrame(void* parameter, uint8_t* /* msg */, int size) {
+    (*(int64_t*)parameter) += size;
+}
+
+static void BenchLayer() {
+    const int sizes[] = {16, 256, 1024, 4096};
+    const int count = 64;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int size = sizes[i];
+        std::vector<uint8_t> stream;
+        for (int k = 0; k < count; k++) {
+            std::vector<uint8_t> frame = WireIFrame(size, (uint16_t)(k + 1));
+            stream.insert(stream.end(), frame.begin(), frame.end());
+        }
+
+        // the frames are taken from the bytes read at once, as a burst from the serial
+        LoopbackPort port;
+        port.Fill(stream, true);
+        protocol::Layer layer(&port);
+        std::unique_ptr<uint8_t[]> buffer(new uint8_t[protocol::cMaxFrameLength]);
+        int64_t received = 0;
+        Bench("layer/read_next_message/" + std::to_string(size), count, (int64_t)count * size, [&] {
+            for (int k = 0; k < count; k++) {
+                layer.ReadNextMessage(buffer.get(), CountFrame, &received, k == 0);
+            }
+        });
+        DoNotOptimize(received);
+    }
+}
+
+static void BenchFrame() {
+    const int sizes[] = {16, 256, 1024};
+    const int count = 1024;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int size = sizes[i];
+        std::vector<uint8_t> stream;
+        for (int k = 0; k < count; k++) {
+            std::vector<uint8_t> frame = WireIFrame(size, (uint16_t)(k + 1));
+            stream.insert(stream.end(), frame.begin(), frame.end());
+        }
+
+        // the frames are validated by Frame::MessageHandler, taken in order and acknowledged, each
+        // iteration starts a new link as the frame numbers go on
+        int64_t received = 0;
+        Bench("frame/receive_iframe/" + std::to_string(size), count, (int64_t)count * size, [&] {
+            LoopbackPort port;
+            port.Fill(stream, false);
+            protocol::Frame frame(&port);
+            frame.SetIFrameHandler([&](uint8_t* /* data */, int len, int /* flags */) {
+                received += len;
+                return true;
+            });
+            while (!port.Drained()) {
+                frame.Run();
+            }
+        });
+        DoNotOptimize(received);
+    }
+}
+
+/// @brief Time the messages sended from a master to another through an in-memory line
+/// @param name name of benchmark
+/// @param size size of message
+/// @param resource the resource of both links, NULL for the heap
+/// @return heap allocations per message once warmed up, -1 if the benchmark is not chosen
+static double BenchSendFrame(const std::string& name, int size, protocol::MemoryResource* resource) {
+    const int count = 32;
+    if (!Selected(name)) {
+        return -1;
+    }
+
+    Pipe ab, ba;
+    PipePort port_a(&ba, &ab), port_b(&ab, &ba);
+    protocol::APCIParameters parameters = {};
+    parameters.time_alive = 15;
+    parameters.time_heart = 20;
+    parameters.memory_resource = resource;
+    protocol::Master a(&port_a, parameters), b(&port_b, parameters);
+    std::mutex mutex;
+    std::condition_variable done;
+    int received = 0;
+    b.SetRecviverHandler([&](uint8_t* /* msg */, int /* len */) {
+        std::lock_guard<std::mutex> lock(mutex);
+        received++;
+        done.notify_one();
+        return true;
+    });
+    a.SetRecviverHandler([](uint8_t* /* msg */, int /* len */) { return true; });
+    a.Start();
+    b.Start();
+    a.StartDT();
+    a.ResetDT();
+
+    // fragmented, framed, acknowledged and joined again through an in-memory line, timed per message
+    std::vector<uint8_t> data = Payload(size);
+    double allocs = Bench(name, count, (int64_t)count * size, [&] {
+        int target;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            target = received + count;
+        }
+        for (int k = 0; k < count; k++) {
+            a.SendFrame(data.data(), size);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return received >= target; });
+    });
+
+    a.Stop();
+    b.Stop();
+    return allocs;
+}
+
+/// @return the benchmarks on arenas which have allocated from the heap
+static int BenchMaster() {
+    const int sizes[] = {256, 4096, 65536};
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int size = sizes[i];
+        BenchSendFrame("master/send_frame/" + std::to_string(size), size, NULL);
+
+        // the arena falls back to the heap when it is used up, which is counted as any allocation
+        std::string name = "master/send_frame_arena/" + std::to_string(size);
+        std::vector<uint8_t> buffer(Selected(name) ? 16 << 20 : 0);
+        protocol::ArenaResource arena(buffer.data(), buffer.size(), protocol::HeapResource());
+        if (BenchSendFrame(name, size, &arena) > 0) {
+            protocol::ArenaStats stats = arena.GetStats();
+            printf("%s allocates from the heap, arena peak %zu of %zu bytes, %llu overflows\n", name.c_str(), stats.peak,
+                   stats.capacity, (unsigned long long)stats.overflows);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static void Usage(const char* name) {
+    printf("usage: %s [--repetitions=N] [--min-time=ms] [--warmup=ms] [filter]\n", name);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--repetitions=", 14) == 0) {
+            options.repetitions = std::max(1, atoi(argv[i] + 14));
+        } else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+            options.min_time = std::max(1, atoi(argv[i] + 11));
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            options.warmup = std::max(1, atoi(argv[i] + 9));
+        } else if (argv[i][0] == '-') {
+            Usage(argv[0]);
+            return 1;
+        } else {
+            options.filter = argv[i];
+        }
+    }
+
+    clog::g_logger_.init_logger(clog::Error, "serial_bench.log");
+    printf("%d repetitions of %d ms after %d ms warmup, per frame in ns and per byte in ns\n", options.repetitions,
+           options.min_time, options.warmup);
+    printf("%-32s %12s %12s %10s %10s %10s %8s %9s %8s\n", "benchmark", "frame med", "frame min", "byte med", "byte min",
+           "byte max", "stddev", "MB/s", "allocs");
+    BenchCrc();
+    BenchCodec();
+    BenchLayer();
+    BenchFrame();
+    int failures = BenchMaster();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+#include <signal.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "gateway/gateway.h"
+#include "log/log.h"
+#include "master.h"
+#include "raw/serial_linux.h"
+
+SerialPortCommon* g_serial_;
+protocol::Master* g_master_;
+bool master_;
+
+bool ConnectionEventHandler(protocol::ConnectionEvent ev) {
+    if (ev != protocol::CONNECTION_BROKEN) {
+        return false;
+    }
+    if (g_serial_->GetLastError() != raw::SERIAL_PORT_ERROR_NONE) {
+        qError << "connection broken!";
+        return false;
+    }
+
+    if (g_serial_->is_open()) {
+        g_serial_->Close();
+    }
+    if (g_serial_->Open()) {
+        g_serial_->Discard();
+        if (master_) {
+            g_master_->StartDT();
+            g_master_->ResetDT();
+        }
+        qInfo << "retry connected!";
+        return true;
+    }
+    return false;
+}
+
+#define USAGE std::cout << "Usage: {-S|-M} <serial_name> <socket_path> [baud_rate]" << std::endl
+
+int main(int argc, char** argvs) {
+    if ((argc != 4 && argc != 5) || argvs[1][0] != '-' || (argvs[1][1] != 'S' && argvs[1][1] != 'M')) {
+        USAGE;
+        return 0;
+    }
+    master_ = argvs[1][1] == 'M';
+    int baud_rate = argc == 5 ? atoi(argvs[4]) : 9600;
+
+    clog::g_logger_.init_logger(clog::Info, "serial_gateway.log");
+
+    // the signals are taken by sigwait, so that no thread is interrupted by them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    SerialPortCommon serial(argvs[2], baud_rate, 8, 'N', 1);
+    g_serial_ = &serial;
+    if (!serial.Open()) {
+        std::cout << "open " << argvs[2] << " failed!" << std::endl;
+        return -1;
+    }
+    serial.Discard();
+
+    protocol::APCIParameters parameters = {};
+    parameters.time_alive = 5;
+    parameters.time_heart = 8;
+    protocol::Master master(&serial, parameters);
+    g_master_ = &master;
+    master.SetConnectionHandler(ConnectionEventHandler);
+    gateway::Gateway gateway(&master, argvs[3]);
+    if (!gateway.Start()) {
+        std::cout << "listen on " << argvs[3] << " failed!" << std::endl;
+        return -1;
+    }
+
+    master.Start();
+    if (master_) {
+        master.StartDT();
+    }
+    master.ResetDT();
+
+    int signal;
+    sigwait(&signals, &signal);
+
+    if (master_) {
+        master.StopDT();
+    }
+    gateway.Stop();
+    master.Stop();
+    return 0;
+}
@@ -0,0 +1,519 @@
+#include "bond.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "log/log.h"
+#include "protocol/codec.h"
+
+namespace bond {
+
+#define DEFAULT_STRIPE_SIZE 1024
+#define DEFAULT_MEMBER_WINDOW 8
+#define DEFAULT_MEMBER_TIMEOUT 5000
+#define CHECK_INTERVAL 10
+#define RETRANSMIT_SAMPLE 32  // i-frames sended before the retransmissions of member are judged
+#define REORDER_FACTOR 2      // stripes waited for are bounded by this times the timeout and windows of members
+
+static uint64_t GetTimeInMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Bond::Bond(const protocol::APCIParameters apci_parameters, const BondParameters parameters)
+    : apci_parameters_(apci_parameters),
+      parameters_(parameters),
+      send_sequence_(0),
+      last_member_(-1),
+      restarting_(false),
+      signaled_(false),
+      receive_sequence_(0),
+      gap_time_(0),
+      resync_(false) {
+    running_ = false;
+    driving_ = false;
+    if (parameters_.stripe_size <= 0) {
+        parameters_.stripe_size = DEFAULT_STRIPE_SIZE;
+    }
+    if (parameters_.window <= 0) {
+        parameters_.window = DEFAULT_MEMBER_WINDOW;
+    }
+    if (parameters_.timeout <= 0) {
+        parameters_.timeout = DEFAULT_MEMBER_TIMEOUT;
+    }
+}
+
+Bond::~Bond() {
+    Stop();
+    for (size_t i = 0; i < members_.size(); i++) {
+        delete members_[i]->master;
+        delete members_[i];
+    }
+}
+
+int Bond::AddMember(SerialPortBase* serial_connection) {
+    if (work_.joinable()) {
+        return -1;
+    }
+
+    int index = (int)members_.size();
+    Member* member = new Member();
+    member->master = new protocol::Master(serial_connection, apci_parameters_);
+    member->active = false;
+    member->confirmed = false;
+    member->progress_time = 0;
+    member->drop_time = 0;
+    member->restart_time = 0;
+    member->frames_sent = 0;
+    member->frames_retransmit = 0;
+    member->stats = {0, 0, 0, 0, 0, 0};
+    members_.push_back(member);
+    received_.push_back(0);
+
+    // the handlers of member only queue events, the stripes are handed by the work thread of bond
+    member->master->SetRecviverHandler(std::bind(&Bond::Deliver, this, index, std::placeholders::_1, std::placeholders::_2));
+    member->master->SetSendCompletionHandler([this, index](uint32_t id, protocol::SendStatus status, uint64_t) {
+        Post(index, status == protocol::SEND_CONFIRMED ? EVENT_CONFIRMED : EVENT_FAILED, id);
+    });
+    member->master->SetConnectionHandler([this, index](protocol::ConnectionEvent event) {
+        switch (event) {
+            case protocol::CONNECTION_RESETDT:
+            case protocol::CONNECTION_RESETDT_CONFIRMED:
+                Post(index, EVENT_UP, 0);
+                break;
+            case protocol::CONNECTION_STOPDT:
+            case protocol::CONNECTION_STOPDT_CONFIRMED:
+            case protocol::CONNECTION_BROKEN:
+                Post(index, EVENT_DOWN, 0);
+                break;
+            default:
+                break;
+        }
+        // the link of member goes on, it is reset again before it takes stripes
+        return true;
+    });
+    return index;
+}
+
+void Bond::Start() {
+    if (!work_.joinable()) {
+        for (size_t i = 0; i < members_.size(); i++) {
+            members_[i]->master->Start();
+        }
+        running_ = true;
+        work_ = std::thread(&Bond::MainThread, this);
+    }
+}
+
+void Bond::Stop() {
+    running_ = false;
+    if (work_.joinable()) {
+        wakeup_.notify_one();
+        work_.join();
+    }
+    for (size_t i = 0; i < members_.size(); i++) {
+        members_[i]->master->Stop();
+    }
+}
+
+void Bond::StartDT() {
+    driving_ = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t now = GetTimeInMs();
+    for (size_t i = 0; i < members_.size(); i++) {
+        members_[i]->restart_time = now;
+        members_[i]->master->StartDT();
+        members_[i]->master->ResetDT();
+    }
+}
+
+void Bond::StopDT() {
+    driving_ = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < members_.size(); i++) {
+        members_[i]->master->StopDT();
+    }
+}
+
+bool Bond::SendFrame(uint8_t* data, int size) {
+    if (data == NULL || size <= 0) {
+        return false;
+    }
+
+    qDebug << "send data len = " << size << " on bond";
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int pos = 0; pos < size; pos += parameters_.stripe_size) {
+            int len = std::min(size - pos, parameters_.stripe_size);
+            Stripe stripe;
+            stripe.sequence = send_sequence_++;
+            stripe.data.resize(cSHeaderLength + len);
+            protocol::StoreLe32(stripe.data.data(), stripe.sequence);
+            stripe.data[4] = (pos + len < size ? STRIPE_MORE : 0) | (pos == 0 ? STRIPE_FIRST : 0);
+            memcpy(stripe.data.data() + cSHeaderLength, data + pos, len);
+            pending_.push_back(std::move(stripe));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(event_mutex_);
+        signaled_ = true;
+    }
+    wakeup_.notify_one();
+    return true;
+}
+
+void Bond::SetRecviverHandler(protocol::MessageReceivedHandler serial_receiver) {
+    std::lock_guard<std::mutex> lock(receive_mutex_);
+    receiver_ = serial_receiver;
+}
+
+void Bond::SetMemberHandler(MemberEventHandler handler) {
+    if (!work_.joinable()) {
+        member_handler_ = handler;
+    }
+}
+
+MemberStats Bond::GetStats(int member) {
+    MemberStats stats = {0, 0, 0, 0, 0, 0};
+    if (member < 0 || member >= (int)members_.size()) {
+        return stats;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats = members_[member]->stats;
+        stats.active = members_[member]->active ? 1 : 0;
+    }
+    std::lock_guard<std::mutex> lock(receive_mutex_);
+    stats.stripes_received = received_[member];
+    return stats;
+}
+
+protocol::LinkStats Bond::GetLinkStats(int member) {
+    if (member < 0 || member >= (int)members_.size()) {
+        protocol::LinkStats stats;
+        memset(&stats, 0, sizeof(stats));
+        return stats;
+    }
+    return members_[member]->master->GetStats();
+}
+
+void Bond::Post(int member, int type, uint32_t id) {
+    {
+        std::lock_guard<std::mutex> lock(event_mutex_);
+        Event event = {member, type, id};
+        events_.push_back(event);
+    }
+    wakeup_.notify_one();
+}
+
+void Bond::MainThread() {
+    while (running_) {
+        {
+            std::unique_lock<std::mutex> lock(event_mutex_);
+            wakeup_.wait_for(lock, std::chrono::milliseconds(CHECK_INTERVAL),
+                             [this] { return signaled_ || events_.size() || !running_; });
+            signaled_ = false;
+            handling_.swap(events_);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            uint64_t now = GetTimeInMs();
+            for (size_t i = 0; i < handling_.size(); i++) {
+                HandleEvent(handling_[i], now);
+            }
+            CheckMembers(now);
+            Schedule(now);
+        }
+        handling_.clear();
+
+        // a gap is given up though no stripe arrives
+        {
+            std::lock_guard<std::mutex> lock(receive_mutex_);
+            CheckGap(GetTimeInMs());
+        }
+
+        // the handler may look at the bond, it is called unlocked
+        for (size_t i = 0; i < changes_.size(); i++) {
+            if (member_handler_) {
+                member_handler_(changes_[i].first, changes_[i].second);
+            }
+        }
+        changes_.clear();
+    }
+}
+
+void Bond::HandleEvent(const Event& event, uint64_t now) {
+    Member* member = members_[event.member];
+    switch (event.type) {
+        case EVENT_CONFIRMED:
+        case EVENT_FAILED: {
+            // the stripes of a member dropped are sended again already, its late ends are ignored
+            auto it = member->handed.find(event.id);
+            if (it == member->handed.end()) {
+                return;
+            }
+            if (event.type == EVENT_CONFIRMED) {
+                member->stats.stripes_confirmed++;
+                member->progress_time = now;
+                if (it->second.data[4] & STRIPE_RESET) {
+                    restarting_ = false;
+                }
+            } else {
+                member->stats.stripes_moved++;
+                Requeue(it->second);
+            }
+            member->handed.erase(it);
+        } break;
+        case EVENT_UP: {
+            // the stripes of the members down are waiting already, they are counted over for the peer
+            bool alone = true;
+            for (size_t i = 0; i < members_.size(); i++) {
+                alone &= !members_[i]->confirmed;
+            }
+            member->confirmed = true;
+            if (alone) {
+                Restart();
+            }
+        } break;
+        case EVENT_DOWN:
+            member->confirmed = false;
+            Drop(event.member, now);
+            break;
+        default:
+            break;
+    }
+}
+
+void Bond::CheckMembers(uint64_t now) {
+    for (int i = 0; i < (int)members_.size(); i++) {
+        Member* member = members_[i];
+        if (member->active) {
+            if (member->handed.size() && now - member->progress_time > (uint64_t)parameters_.timeout) {
+                qWarning << "member " << i << " stalled!";
+                // the link may be alive but stuck, the bond driving it starts it over
+                member->confirmed = !driving_;
+                Drop(i, now);
+                continue;
+            }
+
+            if (parameters_.max_retransmit_rate > 0) {
+                protocol::LinkStats stats = member->master->GetStats();
+                uint64_t sent = stats.frames_sent - member->frames_sent;
+                if (sent >= RETRANSMIT_SAMPLE) {
+                    uint64_t retransmit = stats.frames_retransmit - member->frames_retransmit;
+                    member->frames_sent = stats.frames_sent;
+                    member->frames_retransmit = stats.frames_retransmit;
+                    if (retransmit > parameters_.max_retransmit_rate * sent) {
+                        qWarning << "member " << i << " degraded, " << retransmit << " of " << sent << " frames retransmitted!";
+                        Drop(i, now);
+                    }
+                }
+            }
+            continue;
+        }
+
+        // a member dropped waits for the timeout before it is tried again
+        if (member->drop_time && now - member->drop_time < (uint64_t)parameters_.timeout) {
+            continue;
+        }
+        if (member->confirmed) {
+            protocol::LinkStats stats = member->master->GetStats();
+            member->frames_sent = stats.frames_sent;
+            member->frames_retransmit = stats.frames_retransmit;
+            member->active = true;
+            qInfo << "member " << i << " active";
+            changes_.push_back(std::make_pair(i, true));
+        } else if (driving_ && now - member->restart_time >= (uint64_t)parameters_.timeout) {
+            member->restart_time = now;
+            member->master->StartDT();
+            member->master->ResetDT();
+        }
+    }
+}
+
+void Bond::Drop(int index, uint64_t now) {
+    Member* member = members_[index];
+    if (!member->active) {
+        return;
+    }
+
+    member->active = false;
+    member->drop_time = now;
+    member->stats.drops++;
+    member->stats.stripes_moved += member->handed.size();
+    for (auto it = member->handed.begin(); it != member->handed.end(); ++it) {
+        Requeue(it->second);
+    }
+    member->handed.clear();
+    qWarning << "member " << index << " dropped!";
+    changes_.push_back(std::make_pair(index, false));
+}
+
+void Bond::Requeue(Stripe& stripe) {
+    // the stripes lost go before the ones never sended, the peer is waiting for them
+    auto it = std::lower_bound(pending_.begin(), pending_.end(), stripe.sequence,
+                               [](const Stripe& pending, uint32_t sequence) { return SequenceLess()(pending.sequence, sequence); });
+    pending_.insert(it, std::move(stripe));
+}
+
+void Bond::Restart() {
+    // the peer drops the message cut by the restart, so that its rest is not sended
+    int dropped = 0;
+    while (pending_.size() && !(pending_.front().data[4] & STRIPE_FIRST)) {
+        pending_.pop_front();
+        dropped++;
+    }
+    if (dropped) {
+        qWarning << dropped << " stripes of a message cut by the restart dropped!";
+    }
+
+    send_sequence_ = 0;
+    for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+        it->sequence = send_sequence_++;
+        protocol::StoreLe32(it->data.data(), it->sequence);
+        it->data[4] &= ~STRIPE_RESET;
+    }
+    restarting_ = true;
+    qInfo << "bond restarted, " << pending_.size() << " stripes waiting";
+}
+
+void Bond::Schedule(uint64_t now) {
+    int count = (int)members_.size();
+    // the stripes sended run at most the reorder window of peer ahead of the oldest not confirmed
+    uint32_t limit = (uint32_t)(count * parameters_.window * REORDER_FACTOR);
+    uint32_t oldest = pending_.size() ? pending_.front().sequence : send_sequence_;
+    for (int i = 0; i < count; i++) {
+        for (auto it = members_[i]->handed.begin(); it != members_[i]->handed.end(); ++it) {
+            if (SequenceLess()(it->second.sequence, oldest)) {
+                oldest = it->second.sequence;
+            }
+        }
+    }
+
+    while (pending_.size() && count) {
+        if (pending_.front().sequence - oldest >= limit) {
+            return;
+        }
+        // the first stripe counted over goes alone, so that no later one reaches the peer before it
+        if (restarting_) {
+            for (int i = 0; i < count; i++) {
+                if (members_[i]->handed.size()) {
+                    return;
+                }
+            }
+            pending_.front().data[4] |= STRIPE_RESET;
+        }
+
+        // the least loaded member takes the stripe, members equally loaded take turns
+        int chosen = -1;
+        for (int k = 1; k <= count; k++) {
+            int i = (last_member_ + k) % count;
+            Member* member = members_[i];
+            if (!member->active || (int)member->handed.size() >= parameters_.window) {
+                continue;
+            }
+            if (chosen < 0 || member->handed.size() < members_[chosen]->handed.size()) {
+                chosen = i;
+            }
+        }
+        if (chosen < 0) {
+            return;
+        }
+
+        Member* member = members_[chosen];
+        Stripe& stripe = pending_.front();
+        uint32_t id = member->master->SendFrame(stripe.data.data(), (int)stripe.data.size());
+        if (id == 0) {
+            return;
+        }
+        if (member->handed.empty()) {
+            member->progress_time = now;
+        }
+        member->handed[id] = std::move(stripe);
+        member->stats.stripes_sent++;
+        pending_.pop_front();
+        last_member_ = chosen;
+    }
+}
+
+bool Bond::Deliver(int member, uint8_t* msg, int size) {
+    if (size < cSHeaderLength) {
+        qWarning << "stripe header missing!";
+        return true;
+    }
+
+    uint32_t sequence = protocol::LoadLe32(msg);
+    std::lock_guard<std::mutex> lock(receive_mutex_);
+    received_[member]++;
+    if (msg[4] & STRIPE_RESET) {
+        // the peer counts over, the stripes before are given up
+        if (reorder_.size() || message_.size()) {
+            qWarning << "bond restarted by peer, " << reorder_.size() << " stripes dropped!";
+        }
+        reorder_.clear();
+        message_.clear();
+        receive_sequence_ = sequence;
+        resync_ = false;
+    } else if (SequenceLess()(sequence, receive_sequence_) || reorder_.count(sequence)) {
+        // a stripe sended again after its member was dropped may arrive twice
+        qDebug << "duplicate stripe " << sequence;
+        return true;
+    }
+    reorder_[sequence].assign(msg, msg + size);
+
+    uint32_t expected = receive_sequence_;
+    Reassemble();
+    if (reorder_.empty()) {
+        gap_time_ = 0;
+    } else if (gap_time_ == 0 || receive_sequence_ != expected) {
+        gap_time_ = GetTimeInMs();
+    }
+    CheckGap(GetTimeInMs());
+    return true;
+}
+
+void Bond::Reassemble() {
+    while (reorder_.size() && reorder_.begin()->first == receive_sequence_) {
+        std::vector<uint8_t>& stripe = reorder_.begin()->second;
+        // after a gap, the stripes up to the next message belong to the message dropped
+        if (resync_ && !(stripe[4] & STRIPE_FIRST)) {
+            reorder_.erase(reorder_.begin());
+            receive_sequence_++;
+            continue;
+        }
+        resync_ = false;
+
+        message_.insert(message_.end(), stripe.begin() + cSHeaderLength, stripe.end());
+        bool more = (stripe[4] & STRIPE_MORE) != 0;
+        reorder_.erase(reorder_.begin());
+        receive_sequence_++;
+        if (more) {
+            continue;
+        }
+
+        qDebug << "recv data len = " << message_.size() << " on bond";
+        if (receiver_) {
+            receiver_(message_.data(), (int)message_.size());
+        }
+        message_.clear();
+    }
+}
+
+void Bond::CheckGap(uint64_t now) {
+    // the stripes in flight are bounded by the windows of members, more ahead of the gap means it is lost
+    size_t limit = members_.size() * parameters_.window * REORDER_FACTOR;
+    while (reorder_.size() && (reorder_.size() > limit || now - gap_time_ > (uint64_t)parameters_.timeout * REORDER_FACTOR)) {
+        uint32_t next = reorder_.begin()->first;
+        qWarning << "stripes " << receive_sequence_ << " to " << next - 1 << " lost, message dropped!";
+        message_.clear();
+        receive_sequence_ = next;
+        resync_ = true;
+        Reassemble();
+        gap_time_ = reorder_.size() ? now : 0;
+    }
+}
+
+}  // namespace bond
@@ -0,0 +1,226 @@
+#ifndef _BOND_H
+#define _BOND_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "master.h"
+
+namespace bond {
+
+using raw::SerialPortBase;
+
+/* stripe: [sequence(4)][flags][data], carried as a message of the link of a member */
+const uint8_t cSHeaderLength = 0x5;
+
+enum StripeFlag { STRIPE_MORE = 0x1,    // more stripes of the message follow
+                  STRIPE_FIRST = 0x2,   // first stripe of the message
+                  STRIPE_RESET = 0x4 };  // the sender counts the stripes over from this one
+
+struct BondParameters {
+    int stripe_size;             // user data per stripe, 0 for default
+    int window;                  // stripes in flight per member, 0 for default
+    int timeout;                 // time a member may hold stripes without any confirmed in ms, 0 for default
+    float max_retransmit_rate;   // share of i-frames retransmitted beyond which a member is dropped, 0 to disable
+};
+
+struct MemberStats {
+    int active;                  // the member takes stripes
+    uint64_t stripes_sent;       // stripes handed to the link of member
+    uint64_t stripes_confirmed;  // stripes confirmed by peer
+    uint64_t stripes_moved;      // stripes lost with the member and sended again
+    uint64_t stripes_received;   // stripes received, duplicates included
+    uint64_t drops;              // times the member was dropped
+};
+
+typedef std::function<void(int, bool)> MemberEventHandler;
+
+/// @brief One logical link striped across the links of several serial ports
+/// NOTE: Each member port runs a link of its own with the window, retransmission and checksum of its
+/// master. A message is cut into numbered stripes, which are handed to the members with room in their
+/// window, the least loaded first, so that a faster wire takes more of them. The peer puts the stripes
+/// back in order and joins them into the message. A member whose link breaks, which holds stripes for
+/// the timeout without any confirmed, or which retransmits too much is dropped, and its stripes not
+/// confirmed are sended again on the others. It takes stripes again once its link is reset and the
+/// timeout has passed. A bond counts its stripes over when a member link comes up while no other is
+/// up, the first stripe after tells the peer and the message cut by it is dropped. The stripes sended
+/// run at most twice the windows of members ahead of the oldest not confirmed, which bounds the stripes
+/// the peer holds back. A stripe missing for twice the timeout is given up and its message dropped.
+class Bond {
+   public:
+    /// @param apci_parameters the parameters of the member links
+    /// @param parameters the parameters of bond
+    Bond(const protocol::APCIParameters apci_parameters, const BondParameters parameters);
+    ~Bond();
+
+    /// @brief Add a member port
+    /// NOTE: This function has to be called before start. The port is used as by a master and has to
+    /// outlive the bond.
+    /// @param serial_connection the serial of member
+    /// @return the index of member, -1 if the bond is started
+    int AddMember(SerialPortBase* serial_connection);
+
+    /// @brief Start the work threads of the bond and its members
+    void Start();
+
+    /// @brief Stop the work threads of the bond and its members
+    void Stop();
+
+    /// @brief Start and reset the links of members
+    /// NOTE: The bond calling it drives the links, a member link broken or dropped is started and
+    /// reset again until it is confirmed.
+    void StartDT();
+
+    /// @brief Stop the links of members
+    void StopDT();
+
+    /// @brief Send data to peer over the members
+    /// @param data the msg buffer to be send
+    /// @param size the size of buffer
+    /// @return true in case of success, false otherwise
+    bool SendFrame(uint8_t* data, int size);
+
+    /// @brief Register a callback handler for received msg
+    /// NOTE: The handler is called from the work thread of a member, or of bond when a missing stripe
+    /// is given up, one message at a time in the order of sending.
+    /// @param serial_receiver user provided callback handler function
+    void SetRecviverHandler(protocol::MessageReceivedHandler serial_receiver);
+
+    /// @brief Register a callback handler for a member taking stripes or dropped
+    /// NOTE: The handler is called from the work thread of bond with the index of member and whether
+    /// it is active.
+    /// @param handler user provided callback handler function
+    void SetMemberHandler(MemberEventHandler handler);
+
+    /// @brief Get the statistics of a member
+    /// @param member the index of member
+    /// @return a snapshot of the statistics
+    MemberStats GetStats(int member);
+
+    /// @brief Get the statistics of the link of a member
+    /// @param member the index of member
+    /// @return a snapshot of the statistics
+    protocol::LinkStats GetLinkStats(int member);
+
+   private:
+    enum EventType { EVENT_CONFIRMED,
+                     EVENT_FAILED,
+                     EVENT_UP,
+                     EVENT_DOWN };
+
+    struct Event {
+        int member;
+        int type;  // EventType
+        uint32_t id;
+    };
+
+    struct Stripe {
+        uint32_t sequence;
+        std::vector<uint8_t> data;  // header and data of stripe
+    };
+
+    struct Member {
+        protocol::Master* master;
+        bool active;
+        bool confirmed;          // the link is reset and not broken since
+        uint64_t progress_time;  // time a stripe was last confirmed, or handed to the idle member, in ms
+        uint64_t drop_time;      // time the member was last dropped in ms
+        uint64_t restart_time;   // time the link was last started by the bond in ms
+        uint64_t frames_sent;    // i-frames of link when the retransmissions were last checked
+        uint64_t frames_retransmit;
+        std::map<uint32_t, Stripe> handed;  // stripes handed to the link by the id of message
+        MemberStats stats;
+    };
+
+    /// @brief Stripes compared by sequence, wrapping around
+    struct SequenceLess {
+        bool operator()(uint32_t a, uint32_t b) const { return (int32_t)(a - b) < 0; }
+    };
+
+    /// @brief Main thread function that hands the stripes to members.
+    void MainThread();
+
+    /// @brief Queue an event of member for the work thread
+    void Post(int member, int type, uint32_t id);
+
+    /// @brief Apply an event of member
+    /// NOTE: mutex has to be locked
+    void HandleEvent(const Event& event, uint64_t now);
+
+    /// @brief Drop the members broken, stalled or degraded, take the ones reset again
+    /// NOTE: mutex has to be locked
+    void CheckMembers(uint64_t now);
+
+    /// @brief Stop handing stripes to a member and send its stripes on the others
+    /// NOTE: mutex has to be locked
+    void Drop(int member, uint64_t now);
+
+    /// @brief Put a stripe back to the stripes waiting, in order of sequence
+    /// NOTE: mutex has to be locked
+    void Requeue(Stripe& stripe);
+
+    /// @brief Count the stripes waiting over from 0, as no member is up to carry the ones before
+    /// NOTE: mutex has to be locked
+    void Restart();
+
+    /// @brief Hand the stripes waiting to the members with room in their window
+    /// NOTE: mutex has to be locked
+    void Schedule(uint64_t now);
+
+    /// @brief Callback handler function for a stripe received by a member
+    /// @param member the index of member
+    /// @param msg the stripe
+    /// @param size the size of stripe
+    bool Deliver(int member, uint8_t* msg, int size);
+
+    /// @brief Join the stripes in order into messages and hand them to the receiver
+    /// NOTE: receive_mutex has to be locked
+    void Reassemble();
+
+    /// @brief Give up the stripe expected if it is missing too long or too many are received ahead
+    /// NOTE: receive_mutex has to be locked
+    void CheckGap(uint64_t now);
+
+   private:
+    protocol::APCIParameters apci_parameters_;
+    BondParameters parameters_;
+    std::vector<Member*> members_;
+    std::atomic<bool> running_;
+    std::atomic<bool> driving_;  // the links of members are started by this bond
+    std::thread work_;
+    MemberEventHandler member_handler_;
+    std::vector<std::pair<int, bool>> changes_;  // members activated or dropped, reported unlocked
+
+   private:
+    std::mutex mutex_;
+    std::deque<Stripe> pending_;  // stripes waiting for a member, in order of sequence
+    uint32_t send_sequence_;
+    int last_member_;  // member the last stripe was handed to
+    bool restarting_;  // the stripe counted over from 0 goes alone, until it is confirmed
+
+   private:
+    std::mutex event_mutex_;
+    std::condition_variable wakeup_;
+    std::vector<Event> events_;
+    std::vector<Event> handling_;
+    bool signaled_;
+
+   private:
+    std::mutex receive_mutex_;
+    protocol::MessageReceivedHandler receiver_;
+    std::map<uint32_t, std::vector<uint8_t>, SequenceLess> reorder_;  // stripes received ahead of the one expected
+    std::vector<uint8_t> message_;                                   // stripes of the message being received
+    uint32_t receive_sequence_;                                       // sequence of the stripe expected
+    uint64_t gap_time_;                                               // time the stripe expected is missing since in ms, 0 if none
+    bool resync_;                                                     // stripes are dropped up to the first of a message
+    std::vector<uint64_t> received_;                                  // stripes received per member
+};
+
+}  // namespace bond
+#endif
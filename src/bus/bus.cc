@@ -0,0 +1,336 @@
+#include "bus.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "crc/crc.h"
+#include "log/log.h"
+
+namespace bus {
+
+#define DEFAULT_STATION_WINDOW 4
+#define DEFAULT_STATION_TIMEOUT 100
+#define CHARACTER_TIMEOUT 100
+#define SLAVE_READ_TIMEOUT 100
+
+static uint64_t GetTimeInMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool BusPort::Open() {
+    return is_open_ = true;
+}
+
+void BusPort::Close() {
+    is_open_ = false;
+}
+
+void BusPort::Discard() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    received_.clear();
+}
+
+int BusPort::ReadByte() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!readable_.wait_for(lock, std::chrono::milliseconds(read_timeout_), [this] { return received_.size() > 0; })) {
+        return -1;
+    }
+    int byte = received_.front();
+    received_.pop_front();
+    return byte;
+}
+
+int BusPort::Read(uint8_t* buffer, int length) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (length <= 0 || !readable_.wait_for(lock, std::chrono::milliseconds(read_timeout_), [this] { return received_.size() > 0; })) {
+        return -1;
+    }
+    int bytes = std::min(length, (int)received_.size());
+    std::copy(received_.begin(), received_.begin() + bytes, buffer);
+    received_.erase(received_.begin(), received_.begin() + bytes);
+    return bytes;
+}
+
+int BusPort::Write(uint8_t* buffer, int length) {
+    if (length <= 0 || length > 0xffff) {
+        last_error_ = raw::SERIAL_PORT_ERROR_INVALID_ARGUMENT;
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_.push_back(std::vector<uint8_t>(buffer, buffer + length));
+    return length;
+}
+
+void BusPort::SetTimeout(int timeout) {
+    read_timeout_ = timeout;
+}
+
+void BusPort::Deliver(const uint8_t* data, int size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        received_.insert(received_.end(), data, data + size);
+    }
+    readable_.notify_one();
+}
+
+int BusPort::TakeFrames(std::deque<std::vector<uint8_t>>& frames, int count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int taken = 0;
+    for (; taken < count && queued_.size(); taken++) {
+        frames.push_back(std::vector<uint8_t>());
+        frames.back().swap(queued_.front());
+        queued_.pop_front();
+    }
+    return taken;
+}
+
+void Bus::Start() {
+    if (!work_.joinable()) {
+        if (!serial_connection_->is_open() && !serial_connection_->Open()) {
+            qWarning << "open bus failed!";
+        }
+        running_ = true;
+        work_ = std::thread(&Bus::MainThread, this);
+    }
+}
+
+void Bus::Stop() {
+    running_ = false;
+    if (work_.joinable()) {
+        work_.join();
+    }
+}
+
+bool Bus::SendBusFrame(uint8_t address, int flags, const uint8_t* payload, int size) {
+    send_buffer_.resize(cDHeaderLength + size + (size > 0 ? cDTrailerLength : 0));
+    uint8_t* header = send_buffer_.data();
+    header[0] = cDmark;
+    header[1] = address;
+    header[2] = (uint8_t)flags;
+    header[3] = size & 0xff;
+    header[4] = (size >> 8) & 0xff;
+    header[5] = crc::crc8(header + 1, cDHeaderLength - 2);
+    if (size > 0) {
+        memcpy(header + cDHeaderLength, payload, size);
+        uint16_t crc = crc::crc16(payload, size);
+        header[cDHeaderLength + size] = crc & 0xff;
+        header[cDHeaderLength + size + 1] = (crc >> 8) & 0xff;
+    }
+    return serial_connection_->Write(send_buffer_.data(), (int)send_buffer_.size()) == (int)send_buffer_.size();
+}
+
+bool Bus::ReadBusFrame(int timeout, uint8_t* address, int* flags, std::vector<uint8_t>& payload) {
+    uint64_t deadline = GetTimeInMs() + timeout;
+    uint8_t header[cDHeaderLength];
+    int have = 0;  // bytes of header read, kept from a damaged header when they hold the next mark
+    while (true) {
+        if (have == 0) {
+            // a frame has to start before the deadline, damaged frames are skipped until then
+            uint64_t now = GetTimeInMs();
+            serial_connection_->SetTimeout(now < deadline ? (int)(deadline - now) : 0);
+            while (true) {
+                int read = serial_connection_->ReadByte();
+                if (read == cDmark) {
+                    break;
+                }
+                now = GetTimeInMs();
+                if (now >= deadline || !running_) {
+                    return false;
+                }
+                if (read < 0) {
+                    serial_connection_->SetTimeout((int)(deadline - now));
+                }
+            }
+            header[0] = cDmark;
+            have = 1;
+        }
+
+        serial_connection_->SetTimeout(CHARACTER_TIMEOUT);
+        for (; have < cDHeaderLength; have++) {
+            int read = serial_connection_->ReadByte();
+            if (read < 0) {
+                break;
+            }
+            header[have] = (uint8_t)read;
+        }
+        if (have < cDHeaderLength) {
+            have = 0;
+            continue;
+        }
+        if (crc::crc8(header + 1, cDHeaderLength - 2) != header[cDHeaderLength - 1]) {
+            qWarning << "bus frame checksum error!";
+            // the mark was a payload byte or noise, the frame may start later in the header
+            have = 0;
+            for (int i = 1; i < cDHeaderLength; i++) {
+                if (header[i] == cDmark) {
+                    have = cDHeaderLength - i;
+                    memmove(header, header + i, have);
+                    break;
+                }
+            }
+            continue;
+        }
+        have = 0;
+
+        // the payload carries the poll window too, so that it is checked here and not only by the link
+        int size = header[3] | (header[4] << 8);
+        if (size > 0) {
+            payload.resize(size + cDTrailerLength);
+            int bytes = 0;
+            while (bytes < size + cDTrailerLength) {
+                int read = serial_connection_->Read(payload.data() + bytes, size + cDTrailerLength - bytes);
+                if (read <= 0) {
+                    break;
+                }
+                bytes += read;
+            }
+            if (bytes < size + cDTrailerLength) {
+                qWarning << "bus frame incomplete!";
+                continue;
+            }
+            uint16_t crc = payload[size] | (payload[size + 1] << 8);
+            payload.resize(size);
+            if (crc::crc16(payload.data(), size) != crc) {
+                qWarning << "bus frame payload checksum error!";
+                continue;
+            }
+        } else {
+            payload.clear();
+        }
+        *address = header[1];
+        *flags = header[2];
+        return true;
+    }
+}
+
+BusMaster::~BusMaster() {
+    Stop();
+    for (auto it = stations_.begin(); it != stations_.end(); ++it) {
+        delete it->second.port;
+    }
+}
+
+SerialPortBase* BusMaster::AddStation(uint8_t address, const StationParameters parameters) {
+    if (work_.joinable() || stations_.count(address)) {
+        return NULL;
+    }
+
+    Station station;
+    station.port = new BusPort(serial_connection_->baud_rate());
+    station.parameters = parameters;
+    if (station.parameters.window <= 0 || station.parameters.window > 0xff) {
+        station.parameters.window = DEFAULT_STATION_WINDOW;
+    }
+    if (station.parameters.timeout <= 0) {
+        station.parameters.timeout = DEFAULT_STATION_TIMEOUT;
+    }
+    station.stats = {0, 0, 0, 0};
+    stations_[address] = station;
+    return station.port;
+}
+
+StationStats BusMaster::GetStats(uint8_t address) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    auto it = stations_.find(address);
+    if (it == stations_.end()) {
+        StationStats stats = {0, 0, 0, 0};
+        return stats;
+    }
+    return it->second.stats;
+}
+
+void BusMaster::MainThread() {
+    while (running_) {
+        if (stations_.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(DEFAULT_STATION_TIMEOUT));
+            continue;
+        }
+        for (auto it = stations_.begin(); it != stations_.end() && running_; ++it) {
+            Poll(it->first, it->second);
+        }
+    }
+}
+
+void BusMaster::Poll(uint8_t address, Station& station) {
+    // the frames for the station go with its turn, the window bounds both directions
+    frames_.clear();
+    int down = station.port->TakeFrames(frames_, station.parameters.window);
+    for (size_t i = 0; i < frames_.size(); i++) {
+        if (!SendBusFrame(address, 0, frames_[i].data(), (int)frames_[i].size())) {
+            qWarning << "send to station " << (int)address << " failed!";
+        }
+    }
+    uint8_t window = (uint8_t)station.parameters.window;
+    if (!SendBusFrame(address, BUS_POLL, &window, 1)) {
+        qWarning << "poll station " << (int)address << " failed!";
+    }
+
+    int up = 0;
+    bool missed = true;
+    // the station has the timeout to answer and again for each frame it sends
+    while (running_) {
+        uint8_t from;
+        int flags;
+        if (!ReadBusFrame(station.parameters.timeout, &from, &flags, payload_)) {
+            qDebug << "station " << (int)address << " poll timeout!";
+            break;
+        }
+        // the frames of master heard back on the bus and the ones of other stations are no answer
+        if (!(flags & BUS_UP) || from != address) {
+            continue;
+        }
+        if (payload_.size()) {
+            station.port->Deliver(payload_.data(), (int)payload_.size());
+            up++;
+        }
+        if (flags & BUS_END) {
+            missed = false;
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    station.stats.polls++;
+    station.stats.polls_missed += missed ? 1 : 0;
+    station.stats.frames_down += down;
+    station.stats.frames_up += up;
+}
+
+BusSlave::~BusSlave() {
+    Stop();
+}
+
+void BusSlave::MainThread() {
+    while (running_) {
+        uint8_t address;
+        int flags;
+        if (!ReadBusFrame(SLAVE_READ_TIMEOUT, &address, &flags, payload_)) {
+            continue;
+        }
+        if ((flags & BUS_UP) || address != address_) {
+            continue;
+        }
+        if (!(flags & BUS_POLL)) {
+            if (payload_.size()) {
+                port_.Deliver(payload_.data(), (int)payload_.size());
+            }
+            continue;
+        }
+
+        // the turn ends with the last frame, or an empty one if there is nothing to send
+        int window = payload_.size() ? payload_[0] : 1;
+        frames_.clear();
+        port_.TakeFrames(frames_, window);
+        for (size_t i = 0; i < frames_.size(); i++) {
+            int end = i + 1 == frames_.size() ? BUS_END : 0;
+            SendBusFrame(address_, BUS_UP | end, frames_[i].data(), (int)frames_[i].size());
+        }
+        if (frames_.empty()) {
+            SendBusFrame(address_, BUS_UP | BUS_END, NULL, 0);
+        }
+    }
+}
+
+}  // namespace bus
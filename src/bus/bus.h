@@ -0,0 +1,188 @@
+#ifndef _BUS_H
+#define _BUS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "raw/serial_base.h"
+
+namespace bus {
+
+using raw::SerialPortBase;
+
+/* bus frame: [cDmark][address][flags][size(2)][crc8 of address..size][payload of size bytes][crc16 of payload],
+   the crc16 follows only a payload */
+const uint8_t cDmark = 0x3c;
+const uint8_t cDHeaderLength = 0x6;
+const uint8_t cDTrailerLength = 0x2;
+
+enum BusFlag { BUS_UP = 0x1,    // sended by the slave, the others are sended by the master
+               BUS_POLL = 0x2,  // the slave may send, the payload is the number of frames allowed
+               BUS_END = 0x4 };  // the slave has no more to send in this turn
+
+struct StationParameters {
+    int window;   // link frames the station may send per turn, 0 for default
+    int timeout;  // time the station has to answer a poll or send the next frame in ms, 0 for default
+};
+
+struct StationStats {
+    uint64_t polls;         // turns given to the station
+    uint64_t polls_missed;  // turns ended by timeout
+    uint64_t frames_down;   // link frames sended to the station
+    uint64_t frames_up;     // link frames received from the station
+};
+
+/// @brief The link to one station over the bus, used as the serial of its frame layer
+/// NOTE: Each write is one link frame, it is queued until the turn of station.
+class BusPort : public SerialPortBase {
+   public:
+    BusPort(int baud_rate) : SerialPortBase("bus", baud_rate, 8, 'N', 1) {
+        read_timeout_ = 100;
+    }
+    virtual ~BusPort() { ; }
+
+    virtual bool Open();
+
+    virtual void Close();
+
+    virtual void Discard();
+
+    virtual int ReadByte();
+
+    virtual int Read(uint8_t* buffer, int length);
+
+    virtual int Write(uint8_t* buffer, int length);
+
+    virtual void SetTimeout(int timeout);
+
+    /// @brief Pass the payload of a bus frame to the reader of port
+    /// @param data data pointer to the payload
+    /// @param size size of the payload
+    void Deliver(const uint8_t* data, int size);
+
+    /// @brief Take the link frames written to the port
+    /// @param frames the list to append the frames to
+    /// @param count the number of frames to take at most
+    /// @return the number of frames taken
+    int TakeFrames(std::deque<std::vector<uint8_t>>& frames, int count);
+
+   private:
+    std::mutex mutex_;
+    std::condition_variable readable_;
+    std::deque<uint8_t> received_;
+    std::deque<std::vector<uint8_t>> queued_;  // link frames to be sended
+    int read_timeout_;
+};
+
+class Bus {
+   public:
+    Bus(SerialPortBase* serial_connection) : serial_connection_(serial_connection) {
+        running_ = false;
+    }
+    virtual ~Bus() { ; }
+
+    /// @brief Start the work thread of bus
+    /// NOTE: the serial is opened if it is not
+    void Start();
+
+    /// @brief Stop the work thread of bus
+    void Stop();
+
+   protected:
+    /// @brief Main thread function that runs the bus.
+    virtual void MainThread() = 0;
+
+    /// @brief Send a bus frame
+    /// @param address address of the slave
+    /// @param flags bitmask of BusFlag
+    /// @param payload data pointer to the payload
+    /// @param size size of the payload
+    /// @return true in case of success, false otherwise
+    bool SendBusFrame(uint8_t address, int flags, const uint8_t* payload, int size);
+
+    /// @brief Read the next bus frame
+    /// NOTE: A damaged frame is skipped and the reading goes on from the next mark, until no frame
+    /// has started within the timeout.
+    /// @param timeout the time to wait for the start of frame in ms
+    /// @param address the address of frame
+    /// @param flags the bitmask of BusFlag of frame
+    /// @param payload the buffer to store the payload
+    /// @return true in case of success, false on timeout or stop
+    bool ReadBusFrame(int timeout, uint8_t* address, int* flags, std::vector<uint8_t>& payload);
+
+   protected:
+    SerialPortBase* serial_connection_;
+    std::atomic<bool> running_;
+    std::thread work_;
+    std::vector<uint8_t> send_buffer_;
+};
+
+/// @brief The master of a multidrop bus, polling its stations in turn
+/// NOTE: The master sends the frames queued for a station, then polls it and listens until the station
+/// ends its turn or times out. Only the station polled sends, so that the stations never collide.
+class BusMaster : public Bus {
+   public:
+    BusMaster(SerialPortBase* serial_connection) : Bus(serial_connection) { ; }
+    ~BusMaster();
+
+    /// @brief Add a station to the bus
+    /// NOTE: This function has to be called before start. The port is owned by the bus.
+    /// @param address the address of station, the same as the one of its slave
+    /// @param parameters the window and timeout of station
+    /// @return the serial to create the master of link to station with, NULL if the address is taken
+    SerialPortBase* AddStation(uint8_t address, const StationParameters parameters);
+
+    /// @brief Get the statistics of a station
+    /// @param address the address of station
+    /// @return a snapshot of the statistics
+    StationStats GetStats(uint8_t address);
+
+   private:
+    virtual void MainThread();
+
+    struct Station {
+        BusPort* port;
+        StationParameters parameters;
+        StationStats stats;
+    };
+
+    /// @brief Send the frames queued for a station, poll it and receive its frames
+    /// @param address the address of station
+    /// @param station the station
+    void Poll(uint8_t address, Station& station);
+
+   private:
+    std::map<uint8_t, Station> stations_;
+    std::mutex stats_mutex_;
+    std::deque<std::vector<uint8_t>> frames_;
+    std::vector<uint8_t> payload_;
+};
+
+/// @brief The slave of a multidrop bus, sending only when polled by the master
+class BusSlave : public Bus {
+   public:
+    BusSlave(SerialPortBase* serial_connection, uint8_t address)
+        : Bus(serial_connection), port_(serial_connection->baud_rate()), address_(address) { ; }
+    ~BusSlave();
+
+    /// @brief Get the serial to create the master of link to bus master with
+    /// @return the serial
+    SerialPortBase* Port() { return &port_; }
+
+   private:
+    virtual void MainThread();
+
+   private:
+    BusPort port_;
+    uint8_t address_;
+    std::deque<std::vector<uint8_t>> frames_;
+    std::vector<uint8_t> payload_;
+};
+
+}  // namespace bus
+#endif
@@ -16,5 +16,12 @@ uint16_t crc16(const uint8_t* data, int len);
 /// @return the computed CRC-8 checksum.
 uint8_t crc8(const uint8_t* data, int len);
 
+/// @brief Computes the CRC-32C (Castagnoli) checksum.
+/// NOTE: the crc32 instruction of SSE4.2 is used if the CPU has it, else 8 bytes are taken per step by tables.
+/// @param data data pointer to the input data.
+/// @param len len Length of the input data in bytes.
+/// @return the computed CRC-32C checksum.
+uint32_t crc32c(const uint8_t* data, int len);
+
 }  // namespace crc
 #endif
\ No newline at end of file
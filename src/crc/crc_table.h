@@ -0,0 +1,89 @@
+#ifndef _CRC_TABLE_H
+#define _CRC_TABLE_H
+#include <stdint.h>
+
+#include <type_traits>
+
+namespace crc {
+
+/* The tables are generated at compile time. Functions of C++11 constexpr are single expressions, so that an entry
+   is computed by recursion over the bits and the entries are expanded into an array by a pack of indices. */
+
+template <unsigned... I>
+struct Indices {
+    typedef Indices<I..., (sizeof...(I) + I)...> Twice;
+    typedef Indices<I..., sizeof...(I)> Next;
+};
+
+/// @brief Indices 0 to N - 1, built in log(N) steps to stay within the template depth of compilers
+template <unsigned N>
+struct MakeIndices {
+    typedef typename MakeIndices<N / 2>::type::Twice Half;
+    typedef typename std::conditional<N % 2 != 0, typename Half::Next, Half>::type type;
+};
+
+template <>
+struct MakeIndices<0> {
+    typedef Indices<> type;
+};
+
+/// @brief Array of Generator::Entry(i) for each index
+template <typename Generator, typename Sequence = typename MakeIndices<Generator::size>::type>
+struct Table;
+
+template <typename Generator, unsigned... I>
+struct Table<Generator, Indices<I...> > {
+    static constexpr typename Generator::value_type values[sizeof...(I)] = {Generator::Entry(I)...};
+};
+
+template <typename Generator, unsigned... I>
+constexpr typename Generator::value_type Table<Generator, Indices<I...> >::values[sizeof...(I)];
+
+/* CRC-16/CCITT-FALSE, polynomial 0x1021 */
+constexpr uint16_t crc16_shift(uint16_t crc, int bits) {
+    return bits == 0 ? crc : crc16_shift((crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1), bits - 1);
+}
+
+struct Crc16Generator {
+    typedef uint16_t value_type;
+    static const unsigned size = 256;
+    static constexpr uint16_t Entry(unsigned i) { return crc16_shift((uint16_t)(i << 8), 8); }
+};
+
+/* CRC-8, polynomial 0x07 */
+constexpr uint8_t crc8_shift(uint8_t crc, int bits) {
+    return bits == 0 ? crc : crc8_shift((crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1), bits - 1);
+}
+
+struct Crc8Generator {
+    typedef uint8_t value_type;
+    static const unsigned size = 256;
+    static constexpr uint8_t Entry(unsigned i) { return crc8_shift((uint8_t)i, 8); }
+};
+
+/// @brief Get the CRC-8 checksum updated by one byte
+/// NOTE: usable in constant expressions, the checksums of the fixed frames are computed by the compiler
+constexpr uint8_t crc8_byte(uint8_t crc, uint8_t byte) { return crc8_shift((uint8_t)(crc ^ byte), 8); }
+
+/* CRC-32C, reflected polynomial 0x1EDC6F41. Table k gives the crc of a byte followed by k zero bytes, the 8 tables
+   are laid one after another. */
+constexpr uint32_t crc32c_shift(uint32_t crc, int bits) {
+    return bits == 0 ? crc : crc32c_shift((crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1, bits - 1);
+}
+
+constexpr uint32_t crc32c_zero(uint32_t crc, unsigned count) {
+    return count == 0 ? crc : crc32c_zero((crc >> 8) ^ crc32c_shift(crc & 0xff, 8), count - 1);
+}
+
+struct Crc32cGenerator {
+    typedef uint32_t value_type;
+    static const unsigned size = 8 * 256;
+    static constexpr uint32_t Entry(unsigned i) { return crc32c_zero(crc32c_shift(i & 0xff, 8), i >> 8); }
+};
+
+typedef Table<Crc16Generator> Crc16Table;
+typedef Table<Crc8Generator> Crc8Table;
+typedef Table<Crc32cGenerator> Crc32cTable;
+
+}  // namespace crc
+#endif
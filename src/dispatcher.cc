@@ -0,0 +1,110 @@
+#include "dispatcher.h"
+
+namespace protocol {
+
+Dispatcher::Dispatcher(int threads, int capacity)
+    : capacity_(capacity > 0 ? capacity : 1),
+      pending_(0),
+      running_(true) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        workers_.push_back(std::thread(&Dispatcher::WorkThread, this));
+    }
+}
+
+Dispatcher::~Dispatcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    work_cond_.notify_all();
+    space_cond_.notify_all();
+
+    // the tasks already posted are run before the threads exit
+    for (size_t i = 0; i < workers_.size(); i++) {
+        workers_[i].join();
+    }
+}
+
+bool Dispatcher::Post(const void* key, DispatchTask task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_cond_.wait(lock, [this, key] {
+        auto it = strands_.find(key);
+        return pending_ < capacity_ || !running_ || (it != strands_.end() && it->second.draining);
+    });
+    if (!running_) {
+        return false;
+    }
+
+    Strand& strand = strands_[key];
+    strand.tasks.push_back(task);
+    pending_++;
+    if (!strand.scheduled) {
+        strand.scheduled = true;
+        ready_.push_back(key);
+        work_cond_.notify_one();
+    }
+    return true;
+}
+
+bool Dispatcher::Drain(const void* key) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = strands_.find(key);
+    if (it != strands_.end() && it->second.runner == std::this_thread::get_id()) {
+        it->second.draining = true;
+        done_cond_.notify_all();
+        space_cond_.notify_all();
+        return false;
+    }
+    done_cond_.wait(lock, [this, key] {
+        auto it = strands_.find(key);
+        return it == strands_.end() || it->second.draining;
+    });
+    return true;
+}
+
+int Dispatcher::Pending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_;
+}
+
+void Dispatcher::WorkThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        work_cond_.wait(lock, [this] { return ready_.size() || !running_; });
+        if (ready_.empty()) {
+            break;
+        }
+
+        // the key stays scheduled while its task runs, so that no other thread takes the next one
+        const void* key = ready_.front();
+        ready_.pop_front();
+        DispatchTask task;
+        task.swap(strands_[key].tasks.front());
+        strands_[key].tasks.pop_front();
+        strands_[key].runner = std::this_thread::get_id();
+
+        lock.unlock();
+        task();
+        task = nullptr;
+        lock.lock();
+
+        pending_--;
+        space_cond_.notify_one();
+        // one task per turn, so that a busy key does not hold a thread from the others
+        Strand& strand = strands_[key];
+        strand.runner = std::thread::id();
+        strand.draining = false;
+        if (strand.tasks.size()) {
+            ready_.push_back(key);
+            work_cond_.notify_one();
+        } else {
+            strands_.erase(key);
+            done_cond_.notify_all();
+        }
+    }
+}
+
+}  // namespace protocol
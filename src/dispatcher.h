@@ -0,0 +1,70 @@
+#ifndef _DISPATCHER_H
+#define _DISPATCHER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace protocol {
+
+typedef std::function<void()> DispatchTask;
+
+class Dispatcher {
+   public:
+    /// @brief Start the threads running the tasks posted by links
+    /// @param threads number of threads in the pool, at least 1
+    /// @param capacity tasks waiting in the pool before a link posting one more is blocked, at least 1
+    Dispatcher(int threads, int capacity);
+    ~Dispatcher();
+
+    /// @brief Run a task on the pool
+    /// NOTE: Tasks posted with the same key run one after another in the order they were posted,
+    /// tasks of different keys run concurrently. The caller waits while the pool is full.
+    /// @param key the key of tasks to be ordered, such as the link posting them
+    /// @param task the task to be run
+    /// @return false if the pool is stopped and the task is dropped
+    bool Post(const void* key, DispatchTask task);
+
+    /// @brief Wait until the tasks posted with a key are done
+    /// NOTE: Called from a task of the key, it can not wait for that task and returns false at once.
+    /// Until the task returns, the other waits of the key in Drain and Post are let through, so that
+    /// the task may stop the link posting it.
+    /// @param key the key of tasks
+    /// @return true if the tasks are done, false if called from a task of the key
+    bool Drain(const void* key);
+
+    /// @brief Get the number of tasks posted and not yet done
+    /// @return the number of tasks
+    int Pending();
+
+   private:
+    /// @brief Work thread function that runs the tasks.
+    void WorkThread();
+
+   private:
+    struct Strand {
+        std::deque<DispatchTask> tasks;
+        bool scheduled;  // the key is waiting for or held by a thread
+        bool draining;   // the running task drains its own key, the waits of key are let through
+        std::thread::id runner;  // the thread running the task of key
+    };
+
+   private:
+    std::vector<std::thread> workers_;
+    std::map<const void*, Strand> strands_;
+    std::deque<const void*> ready_;  // keys with tasks in turn for a thread
+    std::mutex mutex_;
+    std::condition_variable work_cond_;
+    std::condition_variable space_cond_;
+    std::condition_variable done_cond_;
+    int capacity_;
+    int pending_;
+    bool running_;
+};
+
+}  // namespace protocol
+#endif
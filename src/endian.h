@@ -34,10 +34,7 @@
 #  define ORDER_LITTLE_ENDIAN 1
 #endif
 
-#ifdef ORDER_LITTLE_ENDIAN
-#define cint16(x, y) (x) + (y << 8)
-#else
-#define cint16(x, y) (x << 8) + (y)
-#endif
+/* x is the low byte of a little-endian field, the value is the same whatever the order of host is */
+#define cint16(x, y) ((x) | ((y) << 8))
 
 #endif /* ENDIAN_H_ */
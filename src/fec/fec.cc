@@ -0,0 +1,263 @@
+#include "fec.h"
+
+#include <string.h>
+
+namespace fec {
+
+#define GF_SIZE 255
+#define MAX_NSYM cMaxNsym
+
+// GF(2^8) with primitive polynomial x^8 + x^4 + x^3 + x^2 + 1
+struct GaloisField {
+    uint8_t exp[GF_SIZE * 2];
+    uint8_t log[GF_SIZE + 1];
+
+    GaloisField() {
+        int x = 1;
+        for (int i = 0; i < GF_SIZE; i++) {
+            exp[i] = (uint8_t)x;
+            log[x] = (uint8_t)i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+        for (int i = GF_SIZE; i < GF_SIZE * 2; i++) {
+            exp[i] = exp[i - GF_SIZE];
+        }
+        log[0] = 0;
+    }
+};
+
+static const GaloisField gf;
+
+static inline uint8_t gf_mul(uint8_t x, uint8_t y) {
+    if (x == 0 || y == 0) {
+        return 0;
+    }
+    return gf.exp[gf.log[x] + gf.log[y]];
+}
+
+static inline uint8_t gf_div(uint8_t x, uint8_t y) {
+    if (x == 0) {
+        return 0;
+    }
+    return gf.exp[gf.log[x] + GF_SIZE - gf.log[y]];
+}
+
+static inline uint8_t gf_pow(int power) {
+    power %= GF_SIZE;
+    if (power < 0) {
+        power += GF_SIZE;
+    }
+    return gf.exp[power];
+}
+
+// evaluate polynomial with coefficients from low to high degree
+static uint8_t poly_eval(const uint8_t* poly, int len, uint8_t x) {
+    uint8_t y = 0;
+    for (int i = len - 1; i >= 0; i--) {
+        y = gf_mul(y, x) ^ poly[i];
+    }
+    return y;
+}
+
+// generator polynomial (x - a^0)(x - a^1)...(x - a^(nsym-1)), from high to low degree
+static void rs_generator(int nsym, uint8_t* gen) {
+    memset(gen, 0, nsym + 1);
+    gen[0] = 1;
+    for (int i = 0; i < nsym; i++) {
+        uint8_t root = gf_pow(i);
+        for (int j = i + 1; j > 0; j--) {
+            gen[j] ^= gf_mul(gen[j - 1], root);
+        }
+    }
+}
+
+static void rs_encode_block(const uint8_t* gen, int nsym, const uint8_t* msg, int len, uint8_t* parity) {
+    memset(parity, 0, nsym);
+    for (int i = 0; i < len; i++) {
+        uint8_t coef = msg[i] ^ parity[0];
+        memmove(parity, parity + 1, nsym - 1);
+        parity[nsym - 1] = 0;
+        if (coef) {
+            for (int j = 0; j < nsym; j++) {
+                parity[j] ^= gf_mul(gen[j + 1], coef);
+            }
+        }
+    }
+}
+
+// correct a codeword in place, codeword[0] is the highest degree coefficient
+static int rs_decode_block(uint8_t* codeword, int len, int nsym) {
+    uint8_t syndrome[MAX_NSYM];
+    bool error = false;
+    for (int i = 0; i < nsym; i++) {
+        uint8_t s = 0, x = gf_pow(i);
+        for (int j = 0; j < len; j++) {
+            s = gf_mul(s, x) ^ codeword[j];
+        }
+        syndrome[i] = s;
+        error |= (s != 0);
+    }
+    if (!error) {
+        return 0;
+    }
+
+    // Berlekamp-Massey, error locator from low to high degree
+    uint8_t locator[MAX_NSYM + 1] = {1};
+    uint8_t prev[MAX_NSYM + 1] = {1};
+    uint8_t temp[MAX_NSYM + 1];
+    int errors = 0, shift = 1;
+    uint8_t prev_discrepancy = 1;
+    for (int n = 0; n < nsym; n++) {
+        uint8_t discrepancy = syndrome[n];
+        for (int i = 1; i <= errors; i++) {
+            discrepancy ^= gf_mul(locator[i], syndrome[n - i]);
+        }
+
+        if (discrepancy == 0) {
+            shift++;
+            continue;
+        }
+
+        uint8_t coef = gf_div(discrepancy, prev_discrepancy);
+        if (2 * errors <= n) {
+            memcpy(temp, locator, sizeof(temp));
+            for (int i = 0; i + shift <= nsym; i++) {
+                locator[i + shift] ^= gf_mul(coef, prev[i]);
+            }
+            errors = n + 1 - errors;
+            memcpy(prev, temp, sizeof(prev));
+            prev_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            for (int i = 0; i + shift <= nsym; i++) {
+                locator[i + shift] ^= gf_mul(coef, prev[i]);
+            }
+            shift++;
+        }
+    }
+    if (errors * 2 > nsym) {
+        return -1;
+    }
+
+    // error evaluator = syndrome * locator mod x^nsym
+    uint8_t evaluator[MAX_NSYM] = {0};
+    for (int i = 0; i < nsym; i++) {
+        for (int j = 0; j <= errors && j <= i; j++) {
+            evaluator[i] ^= gf_mul(syndrome[i - j], locator[j]);
+        }
+    }
+
+    // formal derivative of locator
+    uint8_t derivative[MAX_NSYM] = {0};
+    for (int i = 1; i <= errors; i += 2) {
+        derivative[i - 1] = locator[i];
+    }
+
+    // Chien search and Forney algorithm
+    int found = 0;
+    for (int pos = 0; pos < len; pos++) {
+        int power = len - 1 - pos;
+        uint8_t x_inv = gf_pow(-power);
+        if (poly_eval(locator, errors + 1, x_inv) != 0) {
+            continue;
+        }
+
+        uint8_t denominator = poly_eval(derivative, errors, x_inv);
+        if (denominator == 0) {
+            return -1;
+        }
+        uint8_t magnitude = gf_mul(gf_pow(power), gf_div(poly_eval(evaluator, nsym, x_inv), denominator));
+        codeword[pos] ^= magnitude;
+        found++;
+    }
+
+    if (found != errors) {
+        return -1;
+    }
+    return found;
+}
+
+// every entry point checks nsym here, 1..MAX_NSYM
+static int rs_layout(int size, int nsym, int* block_size) {
+    if (nsym < 1 || nsym > MAX_NSYM || size < 0) {
+        return -1;
+    }
+    int data_size = GF_SIZE - nsym;
+    int blocks = (size + data_size - 1) / data_size;
+    if (blocks == 0) {
+        blocks = 1;
+    }
+    *block_size = (size + blocks - 1) / blocks;
+    return blocks;
+}
+
+int rs_encoded_size(int size, int nsym) {
+    int block_size;
+    int blocks = rs_layout(size, nsym, &block_size);
+    if (blocks < 0) {
+        return -1;
+    }
+    return blocks * (block_size + nsym);
+}
+
+int rs_encode(const uint8_t* data, int size, int nsym, uint8_t* out) {
+    int block_size;
+    int blocks = rs_layout(size, nsym, &block_size);
+    if (blocks < 0) {
+        return -1;
+    }
+
+    uint8_t gen[MAX_NSYM + 1];
+    rs_generator(nsym, gen);
+
+    uint8_t codeword[GF_SIZE];
+    for (int block = 0; block < blocks; block++) {
+        int pos = block * block_size;
+        int len = size - pos < block_size ? size - pos : block_size;
+        if (len < 0) {
+            len = 0;
+        }
+        memset(codeword, 0, block_size);
+        memcpy(codeword, data + pos, len);
+        rs_encode_block(gen, nsym, codeword, block_size, codeword + block_size);
+        for (int i = 0; i < block_size + nsym; i++) {
+            out[i * blocks + block] = codeword[i];
+        }
+    }
+    return blocks * (block_size + nsym);
+}
+
+int rs_decode(const uint8_t* in, int size, int nsym, uint8_t* out) {
+    int block_size;
+    int blocks = rs_layout(size, nsym, &block_size);
+    if (blocks < 0) {
+        return -1;
+    }
+
+    uint8_t codeword[GF_SIZE];
+    int corrected = 0;
+    for (int block = 0; block < blocks; block++) {
+        for (int i = 0; i < block_size + nsym; i++) {
+            codeword[i] = in[i * blocks + block];
+        }
+
+        int fixed = rs_decode_block(codeword, block_size + nsym, nsym);
+        if (fixed < 0) {
+            corrected = -1;
+        } else if (corrected >= 0) {
+            corrected += fixed;
+        }
+
+        int pos = block * block_size;
+        int len = size - pos < block_size ? size - pos : block_size;
+        if (len > 0) {
+            memcpy(out + pos, codeword, len);
+        }
+    }
+    return corrected;
+}
+
+}  // namespace fec
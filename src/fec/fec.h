@@ -0,0 +1,36 @@
+#ifndef _FEC_H
+#define _FEC_H
+#include <stdint.h>
+
+namespace fec {
+
+/* the most parity symbols per codeword, half of them are corrected */
+const int cMaxNsym = 64;
+
+/// @brief Get the size of data after Reed-Solomon encoding.
+/// @param size size of the input data in bytes.
+/// @param nsym number of parity symbols per codeword, 1..cMaxNsym.
+/// @return the size of the encoded data, -1 if nsym is out of range.
+int rs_encoded_size(int size, int nsym);
+
+/// @brief Encode data into interleaved Reed-Solomon codewords over GF(2^8).
+/// NOTE: The data is split evenly into codewords of at most 255 - nsym bytes, and
+/// the codewords are interleaved bytewise so that burst errors spread over all of them.
+/// @param data data pointer to the input data.
+/// @param size size of the input data in bytes.
+/// @param nsym number of parity symbols per codeword, 1..cMaxNsym.
+/// @param out buffer to store the encoded data, at least rs_encoded_size bytes.
+/// @return the size of the encoded data, -1 if nsym is out of range.
+int rs_encode(const uint8_t* data, int size, int nsym, uint8_t* out);
+
+/// @brief Decode interleaved Reed-Solomon codewords and correct errors.
+/// NOTE: Each codeword corrects up to nsym / 2 erroneous bytes, rounded down.
+/// @param in data pointer to the encoded data, rs_encoded_size(size, nsym) bytes.
+/// @param size size of the original data in bytes.
+/// @param nsym number of parity symbols per codeword, 1..cMaxNsym.
+/// @param out buffer to store the decoded data, at least size bytes.
+/// @return number of corrected bytes, or -1 if nsym is out of range or any codeword is uncorrectable.
+int rs_decode(const uint8_t* in, int size, int nsym, uint8_t* out);
+
+}  // namespace fec
+#endif
@@ -0,0 +1,511 @@
+#include "gateway.h"
+#ifdef __linux__
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <vector>
+
+#include "log/log.h"
+
+namespace gateway {
+
+#define GATEWAY_VERSION 1
+#define MAX_CAPACITY 0x4000000
+#define FORWARD_BATCH 64  // messages handed from a client before the next one gets its turn
+#define HELLO_TIMEOUT 1000  // time a client has to send its hello in ms
+
+/* answer to the hello of client, followed by the shared memory and doorbell as rights */
+struct GatewayReply {
+    int32_t status;     // GatewayStatus
+    uint32_t capacity;  // size of data area of each ring granted
+};
+
+static size_t RingOffset(uint32_t capacity) {
+    return (Ring::MemorySize(capacity) + 63) & ~(size_t)63;
+}
+
+static uint64_t GetTimeInMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool SetAddress(struct sockaddr_un* address, const char* path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        return false;
+    }
+    strncpy(address->sun_path, path, sizeof(address->sun_path) - 1);
+    return true;
+}
+
+Gateway::Gateway(protocol::Master* master, const char* path)
+    : master_(master), path_(path), listener_(-1), wakeup_(-1) {
+}
+
+Gateway::~Gateway() {
+    Stop();
+}
+
+bool Gateway::Start() {
+    if (work_.joinable()) {
+        return true;
+    }
+
+    struct sockaddr_un address;
+    if (!SetAddress(&address, path_.c_str())) {
+        qError << "gateway path too long!";
+        return false;
+    }
+    listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener_ < 0) {
+        qError << "gateway socket failed! " << strerror(errno);
+        return false;
+    }
+    unlink(path_.c_str());
+    if (bind(listener_, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener_, 16) < 0) {
+        qError << "gateway listen failed! " << strerror(errno);
+        close(listener_);
+        listener_ = -1;
+        return false;
+    }
+
+    wakeup_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    work_ = std::thread(&Gateway::MainThread, this);
+    qInfo << "gateway listening on " << path_;
+    return true;
+}
+
+void Gateway::Stop() {
+    if (work_.joinable()) {
+        uint64_t one = 1;
+        if (write(wakeup_, &one, sizeof(one)) < 0) {
+            qWarning << "wake gateway failed!";
+        }
+        work_.join();
+    }
+
+    while (clients_.size()) {
+        Disconnect(clients_.begin()->second);
+    }
+    for (size_t i = 0; i < pending_.size(); i++) {
+        close(pending_[i].socket);
+    }
+    pending_.clear();
+    if (listener_ >= 0) {
+        close(listener_);
+        listener_ = -1;
+        unlink(path_.c_str());
+    }
+    if (wakeup_ >= 0) {
+        close(wakeup_);
+        wakeup_ = -1;
+    }
+}
+
+void Gateway::MainThread() {
+    std::vector<struct pollfd> fds;
+    std::vector<Client*> owners;
+    while (true) {
+        bool busy = false;
+        for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+            busy |= Forward(it->second);
+        }
+        for (auto it = clients_.begin(); it != clients_.end();) {
+            Client* client = (it++)->second;
+            if (client->broken) {
+                qWarning << "client of channel " << (int)client->channel << " sended a malformed record, disconnected";
+                Disconnect(client);
+            }
+        }
+
+        // the clients ring the doorbell only while we sleep, so that a busy gateway takes no syscall
+        if (!busy) {
+            for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+                int size;
+                it->second->send.SetConsumerWaiting(true);
+                // a malformed record is found by the next forward
+                busy |= it->second->send.Peek(&size) != NULL || size < 0;
+            }
+        }
+
+        fds.clear();
+        owners.clear();
+        struct pollfd fd = {wakeup_, POLLIN, 0};
+        fds.push_back(fd);
+        fd.fd = listener_;
+        fds.push_back(fd);
+        for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+            fd.fd = it->second->socket;
+            fds.push_back(fd);
+            fd.fd = it->second->doorbell;
+            fds.push_back(fd);
+            owners.push_back(it->second);
+        }
+        // the hellos are read as they arrive, a client not sending its hello in time is dropped
+        uint64_t now = GetTimeInMs();
+        int timeout = busy ? 0 : -1;
+        size_t pending = pending_.size();
+        for (size_t i = 0; i < pending; i++) {
+            fd.fd = pending_[i].socket;
+            fds.push_back(fd);
+            int left = pending_[i].deadline > now ? (int)(pending_[i].deadline - now) : 0;
+            if (timeout < 0 || left < timeout) {
+                timeout = left;
+            }
+        }
+        int ready = poll(fds.data(), fds.size(), timeout);
+        for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+            it->second->send.SetConsumerWaiting(false);
+        }
+        if (ready < 0 && errno != EINTR) {
+            qError << "gateway poll failed! " << strerror(errno);
+            break;
+        }
+        if (ready < 0) {
+            continue;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+        for (size_t i = 0; i < owners.size(); i++) {
+            struct pollfd& socket_fd = fds[2 + i * 2];
+            struct pollfd& doorbell_fd = fds[3 + i * 2];
+            if (doorbell_fd.revents & POLLIN) {
+                uint64_t count;
+                if (read(doorbell_fd.fd, &count, sizeof(count)) < 0) {
+                    qDebug << "doorbell already reset";
+                }
+            }
+            // the client sends nothing on the socket after hello, so that any event is the end of it
+            if (socket_fd.revents) {
+                qInfo << "client of channel " << (int)owners[i]->channel << " disconnected";
+                Disconnect(owners[i]);
+            }
+        }
+
+        // from the back, so that the sockets left keep their place in fds
+        now = GetTimeInMs();
+        for (size_t i = pending; i-- > 0;) {
+            bool over = false;
+            if (fds[2 + owners.size() * 2 + i].revents) {
+                over = Handshake(&pending_[i]);
+            }
+            if (!over && pending_[i].deadline <= now) {
+                qWarning << "client sended no hello in time, dropped";
+                close(pending_[i].socket);
+                over = true;
+            }
+            if (over) {
+                pending_.erase(pending_.begin() + i);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            Accept();
+        }
+    }
+}
+
+void Gateway::Accept() {
+    // the socket is not blocking, so that a client slow with its hello does not hold the gateway
+    int socket = accept4(listener_, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (socket < 0) {
+        return;
+    }
+
+    Pending pending;
+    memset(&pending, 0, sizeof(pending));
+    pending.socket = socket;
+    pending.deadline = GetTimeInMs() + HELLO_TIMEOUT;
+    pending_.push_back(pending);
+}
+
+bool Gateway::Handshake(Pending* pending) {
+    ssize_t result = recv(pending->socket, (uint8_t*)&pending->hello + pending->received, sizeof(pending->hello) - pending->received, 0);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return false;
+    }
+    if (result <= 0) {
+        close(pending->socket);
+        return true;
+    }
+
+    pending->received += result;
+    if (pending->received < sizeof(pending->hello)) {
+        return false;
+    }
+    Admit(pending->socket, pending->hello);
+    return true;
+}
+
+void Gateway::Admit(int socket, const GatewayHello& hello) {
+    GatewayReply reply = {GATEWAY_OK, hello.capacity > MAX_CAPACITY ? MAX_CAPACITY : hello.capacity};
+    Client* client = NULL;
+    int memory_fd = -1;
+    if (hello.version != GATEWAY_VERSION) {
+        reply.status = GATEWAY_ERROR_VERSION;
+    } else if (clients_.count(hello.channel)) {
+        reply.status = GATEWAY_ERROR_CHANNEL;
+    } else {
+        client = new Client();
+        client->socket = socket;
+        client->broken = false;
+        client->channel = hello.channel;
+        client->priority = hello.priority < protocol::PRIORITY_LEVELS ? (protocol::Priority)hello.priority : protocol::PRIORITY_NORMAL;
+        client->memory_size = RingOffset(reply.capacity) * 2;
+        client->memory = MAP_FAILED;
+        client->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        memory_fd = memfd_create("serial-gateway", MFD_CLOEXEC);
+        if (memory_fd >= 0 && ftruncate(memory_fd, client->memory_size) == 0) {
+            client->memory = mmap(NULL, client->memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+        }
+        if (client->memory == MAP_FAILED || client->doorbell < 0) {
+            reply.status = GATEWAY_ERROR_MEMORY;
+        }
+    }
+
+    // the shared memory and doorbell go with the reply as rights of the socket, the reply fits into
+    // the empty buffer of socket though it is not blocking
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&reply, sizeof(reply)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (reply.status == GATEWAY_OK) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+        int rights[2] = {memory_fd, client->doorbell};
+        memcpy(CMSG_DATA(cmsg), rights, sizeof(rights));
+
+        client->send.Attach(client->memory, reply.capacity, true);
+        client->receive.Attach((uint8_t*)client->memory + RingOffset(reply.capacity), reply.capacity, true);
+    }
+    bool sended = sendmsg(socket, &msg, MSG_NOSIGNAL) == sizeof(reply);
+    if (memory_fd >= 0) {
+        close(memory_fd);
+    }
+
+    if (reply.status != GATEWAY_OK || !sended) {
+        qWarning << "client of channel " << (int)hello.channel << " refused, status " << reply.status;
+        if (client) {
+            if (client->memory != MAP_FAILED) {
+                munmap(client->memory, client->memory_size);
+            }
+            if (client->doorbell >= 0) {
+                close(client->doorbell);
+            }
+            delete client;
+        }
+        close(socket);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(client_mutex_);
+        clients_[client->channel] = client;
+    }
+    master_->SetRecviverHandler(client->channel, std::bind(&Gateway::Deliver, this, client->channel, std::placeholders::_1, std::placeholders::_2));
+    qInfo << "client of channel " << (int)client->channel << " connected";
+}
+
+void Gateway::Disconnect(Client* client) {
+    master_->SetRecviverHandler(client->channel, protocol::MessageReceivedHandler());
+    {
+        std::lock_guard<std::mutex> lock(client_mutex_);
+        clients_.erase(client->channel);
+    }
+    munmap(client->memory, client->memory_size);
+    close(client->doorbell);
+    close(client->socket);
+    delete client;
+}
+
+bool Gateway::Forward(Client* client) {
+    int count = 0;
+    int size;
+    const uint8_t* msg;
+    while (count < FORWARD_BATCH && (msg = client->send.Peek(&size)) != NULL) {
+        // the master copies the message into its queue, the record is free after
+        if (size > 0) {
+            master_->SendFrame(client->channel, (uint8_t*)msg, size, client->priority);
+        }
+        if (client->send.Release()) {
+            client->send.WakeProducer();
+        }
+        count++;
+    }
+    if (msg == NULL && size < 0) {
+        client->broken = true;
+    }
+    return count > 0;
+}
+
+bool Gateway::Deliver(uint8_t channel, uint8_t* msg, int size) {
+    std::lock_guard<std::mutex> lock(client_mutex_);
+    auto it = clients_.find(channel);
+    if (it == clients_.end()) {
+        return true;
+    }
+
+    // the link does not wait for a slow client, the message is dropped and counted for it
+    Ring& ring = it->second->receive;
+    uint8_t* record = ring.Reserve(size);
+    if (record == NULL) {
+        ring.Drop();
+        qWarning << "client of channel " << (int)channel << " full, message dropped!";
+        return true;
+    }
+    memcpy(record, msg, size);
+    if (ring.Commit(size)) {
+        ring.WakeConsumer();
+    }
+    return true;
+}
+
+int GatewayClient::Connect(const char* path, uint8_t channel, protocol::Priority priority, uint32_t capacity) {
+    Close();
+
+    struct sockaddr_un address;
+    if (!SetAddress(&address, path)) {
+        return -1;
+    }
+    socket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_ < 0 || connect(socket_, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        Close();
+        return -1;
+    }
+
+    GatewayHello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.version = GATEWAY_VERSION;
+    hello.capacity = capacity;
+    hello.channel = channel;
+    hello.priority = (uint8_t)priority;
+    if (send(socket_, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+        Close();
+        return -1;
+    }
+
+    GatewayReply reply;
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = {&reply, sizeof(reply)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(socket_, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(reply)) {
+        Close();
+        return -1;
+    }
+    if (reply.status != GATEWAY_OK) {
+        Close();
+        return reply.status;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+        Close();
+        return -1;
+    }
+    int rights[2];
+    memcpy(rights, CMSG_DATA(cmsg), sizeof(rights));
+    doorbell_ = rights[1];
+    memory_size_ = RingOffset(reply.capacity) * 2;
+    void* memory = mmap(NULL, memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED, rights[0], 0);
+    close(rights[0]);
+    if (memory == MAP_FAILED) {
+        Close();
+        return GATEWAY_ERROR_MEMORY;
+    }
+    memory_ = memory;
+    send_.Attach(memory_, reply.capacity, false);
+    receive_.Attach((uint8_t*)memory_ + RingOffset(reply.capacity), reply.capacity, false);
+    return GATEWAY_OK;
+}
+
+void GatewayClient::Close() {
+    if (memory_) {
+        munmap(memory_, memory_size_);
+        memory_ = NULL;
+    }
+    if (doorbell_ >= 0) {
+        close(doorbell_);
+        doorbell_ = -1;
+    }
+    if (socket_ >= 0) {
+        close(socket_);
+        socket_ = -1;
+    }
+}
+
+uint8_t* GatewayClient::Reserve(int size, int timeout) {
+    if (!memory_ || size > send_.MaxRecord()) {
+        return NULL;
+    }
+    uint64_t deadline = GetTimeInMs() + timeout;
+    uint8_t* record;
+    while ((record = send_.Reserve(size)) == NULL) {
+        uint64_t now = GetTimeInMs();
+        if (now >= deadline) {
+            return NULL;
+        }
+        send_.WaitWritable(size, (int)(deadline - now));
+    }
+    return record;
+}
+
+void GatewayClient::Commit(int size) {
+    if (send_.Commit(size)) {
+        uint64_t one = 1;
+        if (write(doorbell_, &one, sizeof(one)) < 0) {
+            qWarning << "ring doorbell of gateway failed!";
+        }
+    }
+}
+
+bool GatewayClient::Send(const uint8_t* data, int size, int timeout) {
+    uint8_t* record = Reserve(size, timeout);
+    if (record == NULL) {
+        return false;
+    }
+    memcpy(record, data, size);
+    Commit(size);
+    return true;
+}
+
+const uint8_t* GatewayClient::Receive(int* size, int timeout) {
+    if (!memory_) {
+        return NULL;
+    }
+    uint64_t deadline = GetTimeInMs() + timeout;
+    const uint8_t* msg;
+    while ((msg = receive_.Peek(size)) == NULL) {
+        uint64_t now = GetTimeInMs();
+        if (now >= deadline || *size < 0) {
+            return NULL;
+        }
+        receive_.WaitReadable((int)(deadline - now));
+    }
+    return msg;
+}
+
+void GatewayClient::Release() {
+    receive_.Release();
+}
+
+}  // namespace gateway
+#endif
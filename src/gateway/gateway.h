@@ -0,0 +1,175 @@
+#ifndef _GATEWAY_H
+#define _GATEWAY_H
+#ifdef __linux__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gateway/ring.h"
+#include "master.h"
+
+namespace gateway {
+
+/* hello of client on the socket of gateway, answered with the status and the shared memory and doorbell */
+struct GatewayHello {
+    uint32_t version;
+    uint32_t capacity;  // size of data area of each ring
+    uint8_t channel;    // logical channel of the link owned by client
+    uint8_t priority;   // Priority of the messages sended by client
+    uint8_t reserved[2];
+};
+
+enum GatewayStatus { GATEWAY_OK,
+                     GATEWAY_ERROR_VERSION,
+                     GATEWAY_ERROR_CHANNEL,  // channel is owned by another client
+                     GATEWAY_ERROR_MEMORY,
+};
+
+/// @brief Share the link of a master with the local processes
+/// NOTE: Each client owns a logical channel of the link. It writes the messages to be sended into a
+/// ring in shared memory and rings the doorbell of gateway if the gateway sleeps, the messages received
+/// on its channel are written into another ring it waits on. The messages are handed over in place,
+/// so that the only copy is the one of master.
+class Gateway {
+   public:
+    /// @param master the master of link, started by the owner
+    /// @param path path of the unix socket the clients connect to
+    Gateway(protocol::Master* master, const char* path);
+    ~Gateway();
+
+    /// @brief Listen to the clients
+    /// @return true in case of success, false otherwise
+    bool Start();
+
+    /// @brief Disconnect the clients and stop listening
+    void Stop();
+
+   private:
+    struct Client {
+        int socket;
+        int doorbell;  // eventfd rung by client after sending to a sleeping gateway
+        void* memory;
+        size_t memory_size;
+        uint8_t channel;
+        protocol::Priority priority;
+        Ring send;     // client to gateway
+        Ring receive;  // gateway to client
+        bool broken;   // a malformed record was sended, the client is disconnected
+    };
+
+    /* accepted socket whose hello is not complete yet */
+    struct Pending {
+        int socket;
+        uint64_t deadline;  // time the hello has to be complete by in ms
+        size_t received;    // bytes of hello received
+        GatewayHello hello;
+    };
+
+    /// @brief Main thread function that serves the clients.
+    void MainThread();
+
+    /// @brief Accept a client, its hello is read by Handshake as it arrives
+    void Accept();
+
+    /// @brief Read the rest of hello of an accepted client, and admit it once complete
+    /// @param pending the accepted client
+    /// @return true if the handshake is over, with the client admitted or refused
+    bool Handshake(Pending* pending);
+
+    /// @brief Answer the hello of client and set up its rings
+    /// @param socket the socket of client
+    /// @param hello the hello of client
+    void Admit(int socket, const GatewayHello& hello);
+
+    /// @brief Release the resources of client and its channel
+    /// @param client the client
+    void Disconnect(Client* client);
+
+    /// @brief Hand the messages of client to the master
+    /// NOTE: The client is marked broken on a malformed record, and disconnected by the caller.
+    /// @param client the client
+    /// @return true if any message is handed
+    bool Forward(Client* client);
+
+    /// @brief Callback handler function for message received on the channel of a client
+    /// @param channel the logical channel
+    /// @param msg the msg received by serial
+    /// @param size the size of msg
+    bool Deliver(uint8_t channel, uint8_t* msg, int size);
+
+   private:
+    protocol::Master* master_;
+    std::string path_;
+    int listener_;
+    int wakeup_;  // eventfd to stop the main thread
+    std::thread work_;
+    std::map<uint8_t, Client*> clients_;
+    std::vector<Pending> pending_;  // used by the main thread only
+    std::mutex client_mutex_;
+};
+
+/// @brief The client of a gateway in another process
+class GatewayClient {
+   public:
+    GatewayClient() : socket_(-1), doorbell_(-1), memory_(NULL), memory_size_(0) { ; }
+    ~GatewayClient() { Close(); }
+
+    /// @brief Connect to the gateway and own a logical channel of its link
+    /// @param path path of the unix socket of gateway
+    /// @param channel the logical channel
+    /// @param priority the priority of messages sended
+    /// @param capacity size of each ring, the largest message is about half of it
+    /// @return GatewayStatus, or -1 if the gateway is not reachable
+    int Connect(const char* path, uint8_t channel, protocol::Priority priority, uint32_t capacity);
+
+    /// @brief Disconnect from the gateway
+    void Close();
+
+    /// @brief Get the buffer to write the next message to
+    /// NOTE: the message is sended by Commit, one message may be reserved at a time
+    /// @param size size of the message
+    /// @param timeout the time to wait for space in ms
+    /// @return the buffer, NULL on timeout or if the message is too large
+    uint8_t* Reserve(int size, int timeout);
+
+    /// @brief Send the message written to the reserved buffer
+    /// @param size size of the message
+    void Commit(int size);
+
+    /// @brief Send a message
+    /// @param data the msg buffer to be send
+    /// @param size the size of buffer
+    /// @param timeout the time to wait for space in ms
+    /// @return true in case of success, false on timeout or if the message is too large
+    bool Send(const uint8_t* data, int size, int timeout);
+
+    /// @brief Get the next message received
+    /// NOTE: the message stays valid until Release
+    /// @param size size of the message
+    /// @param timeout the time to wait in ms
+    /// @return the message, NULL on timeout
+    const uint8_t* Receive(int* size, int timeout);
+
+    /// @brief Release the message got by Receive
+    void Release();
+
+    /// @brief Get the number of messages dropped by gateway as the receive ring was full
+    /// @return the number of messages
+    uint32_t Dropped() { return memory_ ? receive_.Dropped() : 0; }
+
+   private:
+    int socket_;
+    int doorbell_;
+    void* memory_;
+    size_t memory_size_;
+    Ring send_;
+    Ring receive_;
+};
+
+}  // namespace gateway
+
+#endif
+#endif
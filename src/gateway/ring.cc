@@ -0,0 +1,187 @@
+#include "ring.h"
+#ifdef __linux__
+#include <linux/futex.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <new>
+
+namespace gateway {
+
+#define RECORD_HEADER 8  // size of record, padded so that the records are aligned to 8 bytes
+#define WRAP_MARK 0xffffffff
+#define MIN_CAPACITY 0x100
+
+static inline uint32_t Align(uint32_t size) {
+    return (size + 7) & ~7u;
+}
+
+static int FutexWait(std::atomic<uint32_t>* word, uint32_t value, int timeout) {
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    // the memory is shared between processes, so that the futex is not private
+    return (int)syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void FutexWake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint32_t RoundCapacity(uint32_t capacity) {
+    uint32_t size = MIN_CAPACITY;
+    while (size < capacity && size < 0x80000000u) {
+        size <<= 1;
+    }
+    return size;
+}
+
+size_t Ring::MemorySize(uint32_t capacity) {
+    return sizeof(RingHeader) + RoundCapacity(capacity);
+}
+
+void Ring::Attach(void* memory, uint32_t capacity, bool create) {
+    capacity = RoundCapacity(capacity);
+    header_ = (RingHeader*)memory;
+    data_ = (uint8_t*)memory + sizeof(RingHeader);
+    mask_ = capacity - 1;
+    if (create) {
+        new (header_) RingHeader();
+        header_->head = 0;
+        header_->tail = 0;
+        header_->capacity = capacity;
+        header_->waiting = 0;
+        header_->dropped = 0;
+    }
+    reserved_ = skip_ = record_ = 0;
+}
+
+int Ring::MaxRecord() {
+    // a record has to fit after the end of data area is skipped
+    return (int)((mask_ + 1) / 2) - RECORD_HEADER;
+}
+
+uint8_t* Ring::Reserve(int size) {
+    if (size < 0 || size > MaxRecord()) {
+        return NULL;
+    }
+
+    uint32_t head = header_->head.load(std::memory_order_relaxed);
+    uint32_t tail = header_->tail.load(std::memory_order_acquire);
+    uint32_t need = Align(RECORD_HEADER + size);
+    uint32_t offset = head & mask_;
+    uint32_t to_end = mask_ + 1 - offset;
+    uint32_t skip = need > to_end ? to_end : 0;
+    if ((head - tail) + skip + need > mask_ + 1) {
+        return NULL;
+    }
+
+    if (skip) {
+        *(uint32_t*)(data_ + offset) = WRAP_MARK;
+        offset = 0;
+    }
+    reserved_ = size;
+    skip_ = (int)skip;
+    return data_ + offset + RECORD_HEADER;
+}
+
+bool Ring::Commit(int size) {
+    if (size > reserved_) {
+        size = reserved_;
+    }
+    uint32_t head = header_->head.load(std::memory_order_relaxed) + skip_;
+    *(uint32_t*)(data_ + (head & mask_)) = (uint32_t)size;
+    header_->head.store(head + Align(RECORD_HEADER + size));
+    reserved_ = skip_ = 0;
+    return (header_->waiting.load() & WAIT_CONSUMER) != 0;
+}
+
+bool Ring::WaitWritable(int size, int timeout) {
+    uint32_t need = Align(RECORD_HEADER + size);
+    uint32_t head = header_->head.load(std::memory_order_relaxed);
+    uint32_t to_end = mask_ + 1 - (head & mask_);
+    need += need > to_end ? to_end : 0;
+
+    uint32_t tail = header_->tail.load();
+    if ((head - tail) + need <= mask_ + 1) {
+        return true;
+    }
+    header_->waiting.fetch_or(WAIT_PRODUCER);
+    tail = header_->tail.load();
+    if ((head - tail) + need > mask_ + 1) {
+        FutexWait(&header_->tail, tail, timeout);
+    }
+    header_->waiting.fetch_and(~(uint32_t)WAIT_PRODUCER);
+    return (head - header_->tail.load()) + need <= mask_ + 1;
+}
+
+const uint8_t* Ring::Peek(int* size) {
+    uint32_t tail = header_->tail.load(std::memory_order_relaxed);
+    uint32_t head = header_->head.load(std::memory_order_acquire);
+    if (head == tail) {
+        *size = 0;
+        return NULL;
+    }
+
+    uint32_t offset = tail & mask_;
+    uint32_t length = *(uint32_t*)(data_ + offset);
+    uint32_t skip = 0;
+    if (length == WRAP_MARK) {
+        skip = mask_ + 1 - offset;
+        offset = 0;
+        length = *(uint32_t*)data_;
+    }
+    // the memory is written by the other process, a record not lying within what it has published is malformed
+    if (length > (uint32_t)MaxRecord() || skip + Align(RECORD_HEADER + length) > head - tail ||
+        offset + Align(RECORD_HEADER + length) > mask_ + 1) {
+        *size = -1;
+        return NULL;
+    }
+    skip_ = (int)skip;
+    record_ = (int)length;
+    *size = record_;
+    return data_ + offset + RECORD_HEADER;
+}
+
+bool Ring::Release() {
+    uint32_t tail = header_->tail.load(std::memory_order_relaxed);
+    header_->tail.store(tail + skip_ + Align(RECORD_HEADER + record_));
+    skip_ = record_ = 0;
+    return (header_->waiting.load() & WAIT_PRODUCER) != 0;
+}
+
+bool Ring::WaitReadable(int timeout) {
+    uint32_t tail = header_->tail.load(std::memory_order_relaxed);
+    if (header_->head.load() != tail) {
+        return true;
+    }
+    // the flag is set before the head is checked again, so that a record committed meanwhile wakes us
+    header_->waiting.fetch_or(WAIT_CONSUMER);
+    uint32_t head = header_->head.load();
+    if (head == tail) {
+        FutexWait(&header_->head, head, timeout);
+    }
+    header_->waiting.fetch_and(~(uint32_t)WAIT_CONSUMER);
+    return header_->head.load() != tail;
+}
+
+void Ring::SetConsumerWaiting(bool waiting) {
+    if (waiting) {
+        header_->waiting.fetch_or(WAIT_CONSUMER);
+    } else {
+        header_->waiting.fetch_and(~(uint32_t)WAIT_CONSUMER);
+    }
+}
+
+void Ring::WakeConsumer() {
+    FutexWake(&header_->head);
+}
+
+void Ring::WakeProducer() {
+    FutexWake(&header_->tail);
+}
+
+}  // namespace gateway
+#endif
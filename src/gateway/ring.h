@@ -0,0 +1,108 @@
+#ifndef _RING_H
+#define _RING_H
+#ifdef __linux__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace gateway {
+
+enum RingWaiter { WAIT_CONSUMER = 0x1,
+                  WAIT_PRODUCER = 0x2 };
+
+/* shared by the processes, the positions are in bytes and wrap at 2^32 */
+struct RingHeader {
+    std::atomic<uint32_t> head;  // written by producer
+    uint32_t capacity;           // size of data area, a power of 2
+    uint8_t reserved0[56];       // producer and consumer positions on different cache lines
+    std::atomic<uint32_t> tail;  // written by consumer
+    uint8_t reserved1[60];
+    std::atomic<uint32_t> waiting;  // bitmask of RingWaiter
+    std::atomic<uint32_t> dropped;  // records dropped by producer on full ring
+};
+
+/// @brief Single producer single consumer ring of records in memory shared between processes
+/// NOTE: Records are written and read in place, so that no copy is made by the ring. A consumer
+/// or producer running out of records or space waits on a futex of the shared positions.
+class Ring {
+   public:
+    Ring() : header_(NULL), data_(NULL), reserved_(0), skip_(0), record_(0) { ; }
+
+    /// @brief Get the size of memory of a ring
+    /// @param capacity size of data area, rounded up to a power of 2
+    /// @return the size in bytes
+    static size_t MemorySize(uint32_t capacity);
+
+    /// @brief Use the memory as ring
+    /// @param memory the memory of MemorySize(capacity) bytes, aligned to 64 bytes
+    /// @param capacity size of data area, rounded up to a power of 2
+    /// @param create whether to initialize the ring, only done by one side
+    void Attach(void* memory, uint32_t capacity, bool create);
+
+    /// @brief Get the largest record the ring takes
+    /// @return the size in bytes
+    int MaxRecord();
+
+    /// @brief Reserve space for the next record
+    /// @param size size of the record
+    /// @return pointer to write the record to, NULL if the ring is full
+    uint8_t* Reserve(int size);
+
+    /// @brief Publish the record reserved
+    /// @param size size of the record, not more than reserved
+    /// @return true if the consumer waits and has to be woken
+    bool Commit(int size);
+
+    /// @brief Wait until the ring has space for a record
+    /// @param size size of the record
+    /// @param timeout the time to wait in ms
+    /// @return true if there is space
+    bool WaitWritable(int size, int timeout);
+
+    /// @brief Get the next record
+    /// NOTE: The record is checked against the positions of ring, the producer may be broken.
+    /// @param size size of the record, 0 if the ring is empty, -1 if the record is malformed
+    /// @return pointer to the record valid until release, NULL if the ring is empty or the record is malformed
+    const uint8_t* Peek(int* size);
+
+    /// @brief Remove the record got by peek
+    /// @return true if the producer waits and has to be woken
+    bool Release();
+
+    /// @brief Wait until the ring has a record
+    /// @param timeout the time to wait in ms
+    /// @return true if there is a record
+    bool WaitReadable(int timeout);
+
+    /// @brief Tell the producer whether the consumer waits by other means than the futex of ring
+    /// @param waiting whether the consumer waits
+    void SetConsumerWaiting(bool waiting);
+
+    /// @brief Wake the consumer waiting on the futex of ring
+    void WakeConsumer();
+
+    /// @brief Wake the producer waiting on the futex of ring
+    void WakeProducer();
+
+    /// @brief Count a record dropped by producer
+    void Drop() { header_->dropped++; }
+
+    /// @brief Get the number of records dropped by producer
+    /// @return the number of records
+    uint32_t Dropped() { return header_->dropped; }
+
+   private:
+    RingHeader* header_;
+    uint8_t* data_;
+    uint32_t mask_;
+    int reserved_;  // size of space reserved by producer
+    int skip_;      // bytes before the record reserved or peeked, the end of data area is skipped
+    int record_;    // size of record peeked
+};
+
+}  // namespace gateway
+
+#endif
+#endif
@@ -0,0 +1,190 @@
+#include "lz.h"
+
+#include <string.h>
+
+namespace lz {
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xffff
+#define LAST_LITERALS 5  // the last bytes are always literals
+#define MATCH_LIMIT 12   // the last match starts at least this far from the end
+#define HASH_BITS 12
+#define RUN_MASK 0xf
+
+static inline uint32_t read32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline int hash4(uint32_t sequence) {
+    return (int)((sequence * 2654435761u) >> (32 - HASH_BITS));
+}
+
+// write the extension bytes of a length exceeding the token nibble
+static inline int write_length(uint8_t* dst, int len) {
+    int n = 0;
+    for (; len >= 0xff; len -= 0xff) {
+        dst[n++] = 0xff;
+    }
+    dst[n++] = (uint8_t)len;
+    return n;
+}
+
+// read the extension bytes of a length, fails past limit before the length can overflow
+static inline bool read_length(const uint8_t* src, int size, int* pos, int* len, int limit) {
+    uint8_t byte;
+    do {
+        if (*pos >= size) {
+            return false;
+        }
+        byte = src[(*pos)++];
+        if (byte > limit - *len) {
+            return false;
+        }
+        *len += byte;
+    } while (byte == 0xff);
+    return true;
+}
+
+// positions below dict_size address the dictionary, the others the input
+struct Window {
+    const uint8_t* src;
+    const uint8_t* dict;
+    int dict_size;
+
+    uint8_t at(int pos) const { return pos < dict_size ? dict[pos] : src[pos - dict_size]; }
+};
+
+int lz_bound(int size) {
+    return size + size / 255 + 16;
+}
+
+int lz_compress(const uint8_t* src, int size, uint8_t* dst, int capacity, const uint8_t* dict, int dict_size) {
+    if (dict == NULL || dict_size < 0) {
+        dict_size = 0;
+    } else if (dict_size > MAX_OFFSET) {
+        dict += dict_size - MAX_OFFSET;
+        dict_size = MAX_OFFSET;
+    }
+
+    Window window = {src, dict, dict_size};
+    int table[1 << HASH_BITS];
+    for (int i = 0; i < (1 << HASH_BITS); i++) {
+        table[i] = -1;
+    }
+    for (int pos = 0; pos + MIN_MATCH <= dict_size; pos++) {
+        table[hash4(read32(dict + pos))] = pos;
+    }
+
+    int op = 0, anchor = 0, ip = 0;
+    while (ip + MATCH_LIMIT < size) {
+        int pos = ip + dict_size;
+        int h = hash4(read32(src + ip));
+        int ref = table[h];
+        table[h] = pos;
+
+        if (ref < 0 || pos - ref > MAX_OFFSET || window.at(ref) != src[ip] || window.at(ref + 1) != src[ip + 1] ||
+            window.at(ref + 2) != src[ip + 2] || window.at(ref + 3) != src[ip + 3]) {
+            ip++;
+            continue;
+        }
+
+        int len = MIN_MATCH;
+        while (ip + len < size - LAST_LITERALS && window.at(ref + len) == src[ip + len]) {
+            len++;
+        }
+
+        // token, literals, offset and match length
+        int literals = ip - anchor;
+        if (op + 1 + literals / 0xff + 1 + literals + 2 + (len - MIN_MATCH) / 0xff + 1 > capacity) {
+            return 0;
+        }
+        uint8_t* token = dst + op++;
+        *token = 0;
+        if (literals >= RUN_MASK) {
+            *token = RUN_MASK << 4;
+            op += write_length(dst + op, literals - RUN_MASK);
+        } else {
+            *token = (uint8_t)(literals << 4);
+        }
+        memcpy(dst + op, src + anchor, literals);
+        op += literals;
+
+        int offset = pos - ref;
+        dst[op++] = offset & 0xff;
+        dst[op++] = (offset >> 8) & 0xff;
+
+        int match = len - MIN_MATCH;
+        if (match >= RUN_MASK) {
+            *token |= RUN_MASK;
+            op += write_length(dst + op, match - RUN_MASK);
+        } else {
+            *token |= (uint8_t)match;
+        }
+
+        ip += len;
+        anchor = ip;
+    }
+
+    // the last sequence has literals only
+    int literals = size - anchor;
+    if (op + 1 + literals / 0xff + 1 + literals > capacity) {
+        return 0;
+    }
+    if (literals >= RUN_MASK) {
+        dst[op++] = RUN_MASK << 4;
+        op += write_length(dst + op, literals - RUN_MASK);
+    } else {
+        dst[op++] = (uint8_t)(literals << 4);
+    }
+    memcpy(dst + op, src + anchor, literals);
+    op += literals;
+    return op;
+}
+
+int lz_decompress(const uint8_t* src, int size, uint8_t* dst, int capacity, const uint8_t* dict, int dict_size) {
+    if (dict == NULL || dict_size < 0) {
+        dict_size = 0;
+    }
+
+    int ip = 0, op = 0;
+    while (ip < size) {
+        uint8_t token = src[ip++];
+        int literals = token >> 4;
+        if (literals == RUN_MASK && !read_length(src, size, &ip, &literals, size)) {
+            return -1;
+        }
+        if (literals > size - ip || literals > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (ip == size) {
+            break;
+        }
+
+        if (size - ip < 2) {
+            return -1;
+        }
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int len = token & RUN_MASK;
+        if (len == RUN_MASK && !read_length(src, size, &ip, &len, capacity - MIN_MATCH)) {
+            return -1;
+        }
+        len += MIN_MATCH;
+        if (offset == 0 || offset > op + dict_size || len > capacity - op) {
+            return -1;
+        }
+
+        // copy bytewise, the match may overlap the output or start in the dictionary
+        for (int i = 0; i < len; i++, op++) {
+            int from = op - offset;
+            dst[op] = from >= 0 ? dst[from] : dict[dict_size + from];
+        }
+    }
+    return op;
+}
+
+}  // namespace lz
@@ -0,0 +1,35 @@
+#ifndef _LZ_H
+#define _LZ_H
+#include <stdint.h>
+
+namespace lz {
+
+/// @brief Get the worst size of data after compression.
+/// @param size size of the input data in bytes.
+/// @return the upper bound of the compressed size.
+int lz_bound(int size);
+
+/// @brief Compress data into the LZ4 block format.
+/// NOTE: Matches may reference the dictionary as if it preceded the data, only the last 64 KB
+/// of the dictionary are used. The same dictionary must be passed to lz_decompress.
+/// @param src data pointer to the input data.
+/// @param size size of the input data in bytes.
+/// @param dst buffer to store the compressed data.
+/// @param capacity size of the output buffer, compression fails if the result does not fit.
+/// @param dict data pointer to the shared dictionary, NULL for none.
+/// @param dict_size size of the shared dictionary in bytes.
+/// @return the size of the compressed data, or 0 if it does not fit into capacity.
+int lz_compress(const uint8_t* src, int size, uint8_t* dst, int capacity, const uint8_t* dict, int dict_size);
+
+/// @brief Decompress data in the LZ4 block format.
+/// @param src data pointer to the compressed data.
+/// @param size size of the compressed data in bytes.
+/// @param dst buffer to store the decompressed data.
+/// @param capacity size of the output buffer.
+/// @param dict data pointer to the shared dictionary used for compression, NULL for none.
+/// @param dict_size size of the shared dictionary in bytes.
+/// @return the size of the decompressed data, or -1 if the input is malformed or does not fit.
+int lz_decompress(const uint8_t* src, int size, uint8_t* dst, int capacity, const uint8_t* dict, int dict_size);
+
+}  // namespace lz
+#endif
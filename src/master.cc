@@ -1,11 +1,31 @@
 #include "master.h"
 
+#include <math.h>
+
+#include <chrono>
+#include <iterator>
+#include <memory>
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#else
+#include <Windows.h>
+#endif
+
 #include "log/log.h"
+#include "lz/lz.h"
 
 namespace protocol {
 
-const uint16_t frame_size = 0x1000;
-const uint16_t frame_limit = frame_size - cIFixedLength;
+const uint16_t fragment_limit = 0x80;
+const uint8_t packed_header = 4;  // original size of compressed message
+
+static uint64_t GetTimeInUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 void Master::StartDT() {
     uint8_t frame[256];
@@ -31,65 +51,492 @@ void Master::StopDT() {
     }
 }
 
-void Master::SendFrame(uint8_t* data, int size) {
-    int pos = 0, offset = frame_limit;
-    uint8_t buffer[frame_size];
-    while (pos < size) {
-        if (size - pos > offset)
-            offset = frame_limit;
-        else
-            offset = size - pos;
+int Master::FragmentSize() {
+    // the frame size negotiated with peer bounds the fragment
+    Capabilities caps = frame_.GetCapabilities();
+    int fixed = IFrameFixedLength((caps.crc_types & CRC_TYPE_32C) ? cWmark : cImark);
+    int frame_limit = caps.frame_size - fixed;
+    int high = (fragment_max_ > 0 && fragment_max_ < frame_limit) ? fragment_max_ : frame_limit;
+    int low = fragment_min_ > 0 ? fragment_min_ : fragment_limit;
+    if (low > high) {
+        low = high;
+    }
+
+    int size = high;
+    double error_rate = frame_.GetStats().byte_error_rate;
+    if (error_rate >= 1) {
+        // nothing got through, start over from the smallest fragment
+        size = low;
+    } else if (error_rate > 0) {
+        // maximize the goodput L / (L + H) * (1 - p) ^ (L + H), H is the overhead of frame and ack
+        double overhead = fixed + 2;
+        double loss = -log(1 - error_rate);
+        double optimal = (sqrt(overhead * overhead + 4 * overhead / loss) - overhead) / 2;
+        if (optimal < high) {
+            size = optimal < low ? low : (int)optimal;
+        }
+    }
+
+    fragment_size_ = size;
+    return size;
+}
+
+LinkStats Master::GetStats() {
+    LinkStats stats = frame_.GetStats();
+    stats.fragment_size = fragment_size_;
+    stats.message_bytes = message_bytes_;
+    return stats;
+}
+
+int Master::Compress(uint8_t* data, int size, Buffer& packed) {
+    Capabilities caps = frame_.GetCapabilities();
+    if (!compression_ || !(caps.features & FEATURE_COMPRESSION) || size <= packed_header) {
+        return 0;
+    }
+
+    bool dictionary = caps.dictionary_id != 0 && dictionary_.size();
+    packed.resize(size);
+    packed[0] = size & 0xff;
+    packed[1] = (size >> 8) & 0xff;
+    packed[2] = (size >> 16) & 0xff;
+    packed[3] = (size >> 24) & 0xff;
+    // incompressible message does not fit and is sended raw
+    int len = lz::lz_compress(data, size, packed.data() + packed_header, size - packed_header - 1,
+                              dictionary ? dictionary_.data() : NULL, dictionary ? (int)dictionary_.size() : 0);
+    if (len <= 0) {
+        return 0;
+    }
+
+    packed.resize(len + packed_header);
+    return IFRAME_COMPRESSED | (dictionary ? IFRAME_DICTIONARY : 0);
+}
+
+uint32_t Master::SendFrame(uint8_t* data, int size) {
+    return SendFrame(0, data, size);
+}
+
+uint32_t Master::SendFrame(uint8_t channel, uint8_t* data, int size) {
+    return SendFrame(channel, data, size, PRIORITY_NORMAL);
+}
+
+uint32_t Master::SendFrame(uint8_t channel, uint8_t* data, int size, Priority priority) {
+    if (priority < PRIORITY_LOW || priority >= PRIORITY_LEVELS) {
+        priority = PRIORITY_NORMAL;
+    }
+    if (data == NULL || size <= 0) {
+        return 0;
+    }
+
+    message_bytes_ += size;
+    qDebug << "send data len = " << size << " on channel " << (int)channel << " priority " << priority;
+
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    message_id_ = message_id_ == 0xffffffff ? 1 : message_id_ + 1;
+    Message msg = {Buffer(data, data + size, channels_.get_allocator()), 0, 0, priority, message_id_, (bool)completion_handler_};
+    if (msg.tracked) {
+        Tracking tracking = {GetTimeInUs(), 0, 0, false};
+        tracking_[msg.id] = tracking;
+    }
+
+    // behind the messages of same or higher priority and the one already started
+    std::list<Message, Allocator<Message>>& messages = GetChannel(channel).messages;
+    auto it = messages.end();
+    while (it != messages.begin()) {
+        auto prev = std::prev(it);
+        if (prev->priority >= priority || prev->pos > 0) {
+            break;
+        }
+        it = prev;
+    }
+    messages.insert(it, std::move(msg));
+    return message_id_;
+}
+
+void Master::SetPriorityWeight(Priority priority, int weight) {
+    if (priority < PRIORITY_LOW || priority >= PRIORITY_LEVELS) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    priority_weight_[priority] = weight > 0 ? weight : 0;
+    priority_credit_[priority] = priority_weight_[priority];
+}
+
+int Master::NextPriority(int pending) {
+    int priority = PRIORITY_LEVELS - 1;
+    for (; priority > PRIORITY_LOW; priority--) {
+        if (!(pending & (1 << priority))) {
+            continue;
+        }
+        // a class without weight or with credit left keeps the link, else it yields to a lower class
+        if (priority_weight_[priority] == 0 || priority_credit_[priority] > 0 || (pending & ((1 << priority) - 1)) == 0) {
+            break;
+        }
+    }
+
+    if (priority_weight_[priority] > 0) {
+        if (priority_credit_[priority] == 0) {
+            priority_credit_[priority] = priority_weight_[priority];
+        }
+        priority_credit_[priority]--;
+    }
+    // the classes above have yielded or are empty, they start a new turn
+    for (int i = priority + 1; i < PRIORITY_LEVELS; i++) {
+        priority_credit_[i] = priority_weight_[i];
+    }
+    return priority;
+}
+
+int Master::PrepareFragment(uint8_t channel, std::vector<uint8_t>& frame_data) {
+    Message& msg = GetChannel(channel).messages.front();
+    if (msg.pos == 0) {
+        // compress when the message starts, the capabilities of peer are known by then
+        msg.flags = Compress(msg.data.data(), (int)msg.data.size(), packed_);
+        if (msg.flags) {
+            qDebug << "compressed to " << packed_.size();
+            msg.data.swap(packed_);
+        }
+        if (channel) {
+            msg.flags |= IFRAME_CHANNEL;
+        }
+    }
+
+    // the wide i-frame and the one carrying the ack always have the flags
+    Capabilities caps = frame_.GetCapabilities();
+    bool wide = (caps.crc_types & CRC_TYPE_32C) != 0;
+    bool ack = (caps.features & FEATURE_ACK) != 0;
+    int header = (msg.flags || wide || ack ? cXFlagsLength : 0) + (ack ? cXAckLength : 0) + (channel ? cXChannelLength : 0);
+    int limit = FragmentSize() - header;
+    if (limit < 1) {
+        limit = 1;
+    }
+    int size = (int)msg.data.size() - msg.pos;
+    if (size > limit) {
+        size = limit;
+    }
+    bool more = msg.pos + size < (int)msg.data.size();
+
+    // the channel leads the user data of every fragment
+    fragment_.clear();
+    if (channel) {
+        fragment_.push_back(channel);
+    }
+    fragment_.insert(fragment_.end(), msg.data.begin() + msg.pos, msg.data.begin() + msg.pos + size);
+    msg.pos += size;
+
+    frame_data.resize(fragment_.size() + cXFlagsLength + cXAckLength + IFrameFixedLength(cWmark));
+    return Frame::PrepareIFrame(fragment_.data(), (int)fragment_.size(), frame_data.data(),
+                                msg.flags | (more ? IFRAME_MORE : 0) | (wide ? IFRAME_CRC32C : 0) | (ack ? IFRAME_ACK : 0));
+}
+
+void Master::SendFragments() {
+    Capabilities caps = frame_.GetCapabilities();
+    bool multiplex = (caps.features & FEATURE_CHANNELS) != 0;
+    // keep one frame beyond the window ready, so that the link never waits for us
+    while (frame_.QueuedFrames() <= caps.window_size) {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        // the message at the front of each channel competes with its priority
+        int pending = 0;
+        for (auto it = channels_.begin(); it != channels_.end(); ++it) {
+            if (it->second.messages.size() && (it->first == 0 || multiplex)) {
+                pending |= 1 << it->second.messages.front().priority;
+            }
+        }
+        if (!pending) {
+            return;
+        }
+
+        // channels of the same priority take turns
+        int priority = NextPriority(pending);
+        auto it = channels_.upper_bound(last_channel_);
+        for (size_t count = 0; count < channels_.size(); count++, ++it) {
+            if (it == channels_.end()) {
+                it = channels_.begin();
+            }
+            if (it->second.messages.size() && (it->first == 0 || multiplex) && it->second.messages.front().priority == priority) {
+                break;
+            }
+        }
 
-        int len = protocol::Frame::PrepareIFrame(data + pos, offset, buffer, pos + offset < size);
-        frame_.SendFrame(buffer, len);
-        pos += offset;
+        Message& msg = it->second.messages.front();
+        int len = PrepareFragment(it->first, frame_data_);
+        uint32_t tag = 0;
+        if (msg.tracked) {
+            tag = msg.id;
+            Tracking& tracking = tracking_[msg.id];
+            tracking.fragments++;
+            tracking.handed = msg.pos >= (int)msg.data.size();
+        }
+        if (msg.pos >= (int)msg.data.size()) {
+            it->second.messages.pop_front();
+        }
+        last_channel_ = it->first;
+        frame_.SendFrame(frame_data_.data(), len, tag);
+    }
+}
+
+Master::Channel& Master::GetChannel(uint8_t id) {
+    auto it = channels_.find(id);
+    if (it == channels_.end()) {
+        it = channels_.insert(std::make_pair(id, Channel(channels_.get_allocator().resource()))).first;
+    }
+    return it->second;
+}
+
+void Master::ResetChannels() {
+    std::vector<std::pair<uint32_t, uint64_t>> failed;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        for (auto it = channels_.begin(); it != channels_.end(); ++it) {
+            it->second.buffer.clear();
+            it->second.discarding = false;
+            // the fragments handed to the link are dropped, the rest alone is useless to peer
+            if (it->second.messages.size() && it->second.messages.front().pos > 0) {
+                qWarning << "drop partial message on channel " << (int)it->first;
+                auto tracking = tracking_.find(it->second.messages.front().id);
+                if (tracking != tracking_.end()) {
+                    failed.push_back(std::make_pair(tracking->first, tracking->second.send_time));
+                    tracking_.erase(tracking);
+                }
+                it->second.messages.pop_front();
+            }
+        }
+    }
+
+    for (size_t i = 0; i < failed.size(); i++) {
+        Complete(failed[i].first, SEND_FAILED, failed[i].second);
+    }
+}
+
+void Master::ConfirmHandler(uint32_t id, bool confirmed) {
+    uint64_t send_time;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        auto it = tracking_.find(id);
+        if (it == tracking_.end()) {
+            return;
+        }
+
+        // fragments are confirmed in order, the message ends with its last one or any one lost
+        it->second.confirmed++;
+        if (confirmed && (!it->second.handed || it->second.confirmed < it->second.fragments)) {
+            return;
+        }
+        send_time = it->second.send_time;
+        tracking_.erase(it);
+    }
+    Complete(id, confirmed ? SEND_CONFIRMED : SEND_FAILED, send_time);
+}
+
+void Master::Complete(uint32_t id, SendStatus status, uint64_t send_time) {
+    uint64_t latency = GetTimeInUs() - send_time;
+    qDebug << "message " << id << (status == SEND_CONFIRMED ? " confirmed" : " failed") << " after " << latency << " us";
+    std::shared_ptr<SendCompletionHandler> handler;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        handler = completion_handler_;
+    }
+    if (handler && dispatcher_) {
+        dispatcher_->Post(this, std::bind(*handler, id, status, latency));
+    } else if (handler) {
+        (*handler)(id, status, latency);
     }
-    qDebug << "send data len = " << size;
 }
 
 void Master::SetRecviverHandler(MessageReceivedHandler serial_receiver) {
-    serial_receiver_ = serial_receiver;
+    SetRecviverHandler(0, serial_receiver);
+}
+
+void Master::SetRecviverHandler(uint8_t channel, MessageReceivedHandler serial_receiver) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    GetChannel(channel).receiver = serial_receiver ? std::make_shared<MessageReceivedHandler>(serial_receiver) : NULL;
+}
+
+void Master::SetSendCompletionHandler(SendCompletionHandler handler) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    completion_handler_ = handler ? std::make_shared<SendCompletionHandler>(handler) : NULL;
 }
 
 void Master::SetConnectionHandler(ConnectionEventHandler handler) {
     connection_ev_handler_ = handler;
 }
 
+void Master::SetDispatcher(Dispatcher* dispatcher) {
+    if (!work_.joinable()) {
+        dispatcher_ = dispatcher;
+    }
+}
+
+void Master::SetThreadParameters(const ThreadParameters parameters) {
+    if (!work_.joinable()) {
+        thread_parameters_ = parameters;
+    }
+}
+
+int Master::GetThreadSettings() {
+    return thread_settings_;
+}
+
+int Master::ApplyThreadParameters() {
+    int settings = 0;
+    const ThreadParameters& parameters = thread_parameters_;
+#ifdef __linux__
+    if (parameters.policy == SCHED_POLICY_FIFO || parameters.policy == SCHED_POLICY_RR) {
+        int policy = parameters.policy == SCHED_POLICY_FIFO ? SCHED_FIFO : SCHED_RR;
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = parameters.priority;
+        int error = pthread_setschedparam(pthread_self(), policy, &param);
+        if (error == 0) {
+            settings |= SETTING_SCHEDULING;
+        } else {
+            qWarning << "set scheduling of work thread failed! " << strerror(error);
+        }
+    }
+
+    if (parameters.cpu_mask) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (parameters.cpu_mask & (1ULL << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (error == 0) {
+            settings |= SETTING_AFFINITY;
+        } else {
+            qWarning << "set affinity of work thread failed! " << strerror(error);
+        }
+    }
+#else
+    if (parameters.policy == SCHED_POLICY_FIFO || parameters.policy == SCHED_POLICY_RR) {
+        if (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+            settings |= SETTING_SCHEDULING;
+        } else {
+            qWarning << "set scheduling of work thread failed! " << GetLastError();
+        }
+    }
+
+    if (parameters.cpu_mask) {
+        if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)parameters.cpu_mask)) {
+            settings |= SETTING_AFFINITY;
+        } else {
+            qWarning << "set affinity of work thread failed! " << GetLastError();
+        }
+    }
+#endif
+    return settings;
+}
+
 bool Master::ConnectionHandler(UFrame frame) {
     if (connection_ev_handler_) {
+        ConnectionEvent event;
         switch (frame) {
             case START:
-                connection_ev_handler_(CONNECTION_STARTDT);
+                event = CONNECTION_STARTDT;
                 break;
             case STARTC:
-                connection_ev_handler_(CONNECTION_STARTDT_CONFIRMED);
+                event = CONNECTION_STARTDT_CONFIRMED;
                 break;
             case RESET:
-                connection_ev_handler_(CONNECTION_RESETDT);
+                event = CONNECTION_RESETDT;
                 break;
             case RESETC:
-                connection_ev_handler_(CONNECTION_RESETDT_CONFIRMED);
+                event = CONNECTION_RESETDT_CONFIRMED;
                 break;
             case STOP:
-                connection_ev_handler_(CONNECTION_STOPDT);
+                event = CONNECTION_STOPDT;
                 break;
             case STOPC:
-                connection_ev_handler_(CONNECTION_STOPDT_CONFIRMED);
+                event = CONNECTION_STOPDT_CONFIRMED;
                 break;
             default:
-                break;
+                return true;
+        }
+
+        if (dispatcher_) {
+            dispatcher_->Post(this, std::bind(connection_ev_handler_, event));
+        } else {
+            connection_ev_handler_(event);
         }
     }
     return true;
 }
 
-bool Master::DefaultRecviverHandler(uint8_t* msg, int size, bool more) {
-    buffer_.insert(buffer_.end(), msg, msg + size);
-    if (!more) {
-        serial_receiver_(buffer_.data(), (int)buffer_.size());
-        qDebug << "recv data len = " << buffer_.size();
-        buffer_.clear();
+bool Master::DefaultRecviverHandler(uint8_t* msg, int size, int flags) {
+    uint8_t id = 0;
+    if (flags & IFRAME_CHANNEL) {
+        if (size < cXChannelLength) {
+            qWarning << "channel of message missing!";
+            return true;
+        }
+        id = msg[0];
+        msg += cXChannelLength;
+        size -= cXChannelLength;
+    }
+
+    std::shared_ptr<MessageReceivedHandler> receiver;
+    Channel* channel;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        channel = &GetChannel(id);
+        receiver = channel->receiver;
     }
+
+    Buffer& buffer = channel->buffer;
+    if (channel->discarding || buffer.size() + size > (size_t)message_max_) {
+        // the fragments of a message too large are dropped up to its last one
+        if (!channel->discarding) {
+            qWarning << "message too large on channel " << (int)id << ", dropped!";
+        }
+        buffer.clear();
+        channel->discarding = (flags & IFRAME_MORE) != 0;
+        return true;
+    }
+    buffer.insert(buffer.end(), msg, msg + size);
+    if (flags & IFRAME_MORE) {
+        return true;
+    }
+
+    if (flags & IFRAME_COMPRESSED) {
+        bool dictionary = (flags & IFRAME_DICTIONARY) != 0;
+        int len = -1;
+        uint32_t original = 0;
+        if (buffer.size() > packed_header) {
+            original = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+        }
+        // a block expands at most 255 times, anything beyond is malformed
+        if (original > 0 && original / 0xff <= buffer.size() && original <= (uint32_t)message_max_ &&
+            (!dictionary || dictionary_.size())) {
+            unpacked_.resize(original);
+            len = lz::lz_decompress(buffer.data() + packed_header, (int)buffer.size() - packed_header, unpacked_.data(), (int)original,
+                                    dictionary ? dictionary_.data() : NULL, dictionary ? (int)dictionary_.size() : 0);
+            if (len != (int)original) {
+                len = -1;
+            }
+        }
+
+        buffer.clear();
+        if (len < 0) {
+            qWarning << "decompress message failed!";
+            return true;
+        }
+        qDebug << "decompressed to " << len;
+        buffer.swap(unpacked_);
+    }
+
+    qDebug << "recv data len = " << buffer.size() << " on channel " << (int)id;
+    if (receiver && dispatcher_) {
+        // the message moves to the pool, the buffer starts over for the next one
+        std::shared_ptr<Buffer> message = std::allocate_shared<Buffer>(buffer.get_allocator(), buffer.get_allocator());
+        message->swap(buffer);
+        dispatcher_->Post(this, [receiver, message] { (*receiver)(message->data(), (int)message->size()); });
+    } else if (receiver) {
+        (*receiver)(buffer.data(), (int)buffer.size());
+    } else {
+        qWarning << "no handler for channel " << (int)id;
+    }
+    buffer.clear();
     return true;
 }
 
@@ -97,9 +544,38 @@ void Master::Start() {
     if (!work_.joinable()) {
         frame_.SetIFrameHandler(std::bind(&Master::DefaultRecviverHandler, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
         frame_.SetUFrameHandler(std::bind(&Master::ConnectionHandler, this, std::placeholders::_1));
+        frame_.SetConfirmHandler(std::bind(&Master::ConfirmHandler, this, std::placeholders::_1, std::placeholders::_2));
+        frame_.SetResetHandler(std::bind(&Master::ResetChannels, this));
 
-        buffer_.reserve(frame_limit);
-        work_ = std::thread(&Master::MainThread, this);
+        int settings = 0;
+        {
+            std::lock_guard<std::mutex> lock(channel_mutex_);
+            GetChannel(0).buffer.reserve(FragmentSize());
+            if (thread_parameters_.lock_memory) {
+                // reserved before the memory is locked, so that the pages are faulted in by then
+                GetChannel(0).buffer.reserve(frame_.GetCapabilities().frame_size);
+                unpacked_.reserve(frame_.GetCapabilities().frame_size);
+            }
+        }
+#ifdef __linux__
+        // the whole process is locked, the pages mapped later, such as the stack of work thread, are
+        // locked as they are mapped
+        if (thread_parameters_.lock_memory) {
+            if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+                settings |= SETTING_MEMORY_LOCK;
+            } else {
+                qWarning << "lock memory failed! " << strerror(errno);
+            }
+        }
+#else
+        if (thread_parameters_.lock_memory) {
+            qWarning << "lock memory is not supported!";
+        }
+#endif
+        std::promise<int> applied;
+        std::future<int> applied_settings = applied.get_future();
+        work_ = std::thread(&Master::MainThread, this, &applied);
+        thread_settings_ = settings | applied_settings.get();
     }
 }
 
@@ -108,18 +584,35 @@ void Master::Stop() {
         running_ = false;
     }
 
+    // from a handler on the dispatcher the drain returns at once, and lets the work thread past its
+    // waits for the handlers, so that the join does not wait for the caller
+    bool handler = dispatcher_ && !dispatcher_->Drain(this);
     if (work_.joinable()) {
         work_.join();
     }
 
-    buffer_.clear();
-    buffer_.shrink_to_fit();
+    // no handler is called after stop, but the one calling it
+    if (dispatcher_ && !handler) {
+        dispatcher_->Drain(this);
+    }
+
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    for (auto it = channels_.begin(); it != channels_.end(); ++it) {
+        it->second.buffer.clear();
+        it->second.buffer.shrink_to_fit();
+    }
 }
 
-void Master::MainThread() {
+void Master::MainThread(std::promise<int>* applied) {
+    // no frame is handled before the thread is set up, and start returns with the loop running
     running_ = true;
+    applied->set_value(ApplyThreadParameters());
     while (running_) {
+        SendFragments();
         if (!frame_.Run()) {
+            if (dispatcher_) {
+                dispatcher_->Drain(this);
+            }
             if (connection_ev_handler_) {
                 running_ = connection_ev_handler_(CONNECTION_BROKEN);
             } else {
@@ -1,13 +1,22 @@
 #ifndef _MASTER_H
 #define _MASTER_H
 
+#include <atomic>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
+#include "dispatcher.h"
 #include "protocol/frame.h"
 
 namespace protocol {
 
+#define DEFAULT_MESSAGE_MAX 0x1000000  // largest message accepted from peer
+
 enum ConnectionEvent { CONNECTION_STARTDT,
                        CONNECTION_STARTDT_CONFIRMED,
                        CONNECTION_RESETDT,
@@ -17,15 +26,83 @@ enum ConnectionEvent { CONNECTION_STARTDT,
                        CONNECTION_BROKEN,
 };
 
+enum Priority { PRIORITY_LOW,
+                PRIORITY_NORMAL,
+                PRIORITY_HIGH,
+                PRIORITY_URGENT,
+                PRIORITY_LEVELS,
+};
+
+enum SendStatus { SEND_CONFIRMED,  // every fragment is confirmed by peer
+                  SEND_FAILED,     // dropped on reset of the link
+};
+
+enum SchedPolicy { SCHED_POLICY_DEFAULT,  // time sharing of the system
+                   SCHED_POLICY_FIFO,     // real-time, runs until it blocks or a higher priority is ready
+                   SCHED_POLICY_RR,       // real-time, round robin with the same priority
+};
+
+enum ThreadSetting { SETTING_SCHEDULING = 0x1,
+                     SETTING_AFFINITY = 0x2,
+                     SETTING_MEMORY_LOCK = 0x4 };
+
+struct ThreadParameters {
+    int policy;         // SchedPolicy of the work thread
+    int priority;       // real-time priority of the work thread, 1..99 on linux
+    uint64_t cpu_mask;  // bitmask of cpus the work thread runs on, 0 for any
+    int lock_memory;    // lock all pages of the whole process in memory and prefault the buffers of link, 0 to disable
+};
+
 typedef std::function<bool(ConnectionEvent)> ConnectionEventHandler;
 typedef std::function<bool(uint8_t*, int)> MessageReceivedHandler;
+typedef std::function<void(uint32_t, SendStatus, uint64_t)> SendCompletionHandler;
 
 class Master {
    public:
     Master(SerialPortBase* serial_connection)
-        : frame_(serial_connection) { running_ = false; }
+        : frame_(serial_connection),
+          dispatcher_(NULL),
+          last_channel_(0),
+          message_id_(0),
+          fragment_min_(0),
+          fragment_max_(0),
+          fragment_size_(0),
+          compression_(false),
+          message_max_(DEFAULT_MESSAGE_MAX),
+          message_bytes_(0) {
+        running_ = false;
+        for (int i = 0; i < PRIORITY_LEVELS; i++) {
+            priority_weight_[i] = priority_credit_[i] = 0;
+        }
+        thread_parameters_ = {SCHED_POLICY_DEFAULT, 0, 0, 0};
+        thread_settings_ = 0;
+    }
     Master(SerialPortBase* serial_connection, const APCIParameters apci_parameters)
-        : frame_(serial_connection, apci_parameters) { running_ = false; }
+        : frame_(serial_connection, apci_parameters),
+          dispatcher_(NULL),
+          channels_(ChannelMap::allocator_type(apci_parameters.memory_resource)),
+          last_channel_(0),
+          tracking_(TrackingMap::allocator_type(apci_parameters.memory_resource)),
+          message_id_(0),
+          fragment_min_(apci_parameters.fragment_min),
+          fragment_max_(apci_parameters.fragment_max),
+          fragment_size_(0),
+          compression_(apci_parameters.compression != 0),
+          packed_(Buffer::allocator_type(apci_parameters.memory_resource)),
+          fragment_(Buffer::allocator_type(apci_parameters.memory_resource)),
+          unpacked_(Buffer::allocator_type(apci_parameters.memory_resource)),
+          message_max_(apci_parameters.message_max > 0 ? apci_parameters.message_max : DEFAULT_MESSAGE_MAX),
+          message_bytes_(0) {
+        running_ = false;
+        for (int i = 0; i < PRIORITY_LEVELS; i++) {
+            priority_weight_[i] = priority_credit_[i] = 0;
+        }
+        thread_parameters_ = {SCHED_POLICY_DEFAULT, 0, 0, 0};
+        thread_settings_ = 0;
+        if (apci_parameters.dictionary != NULL && apci_parameters.dictionary_size > 0) {
+            dictionary_.assign(apci_parameters.dictionary, apci_parameters.dictionary + apci_parameters.dictionary_size);
+        }
+    }
     ~Master() { ; }
 
     /// @brief Initialize the environment of commucation
@@ -33,7 +110,8 @@ class Master {
     void Start();
 
     /// @brief Release the environment of commucation
-    /// NOTE: This function has to be called at end
+    /// NOTE: This function has to be called at end. With a dispatcher, it waits for the handlers
+    /// pending, but the one calling it.
     void Stop();
 
     /// @brief Start the commucation
@@ -51,7 +129,38 @@ class Master {
     /// @brief Send data to peer by serial
     /// @param data the msg buffer to be send
     /// @param size the size of buffer
-    void SendFrame(uint8_t* data, int size);
+    /// @return the id of message passed to the send completion handler, 0 if nothing is sended
+    uint32_t SendFrame(uint8_t* data, int size);
+
+    /// @brief Send data to peer on a logical channel
+    /// NOTE: The fragments of messages on different channels interleave on the link, a message on
+    /// channel other than 0 waits until the peer is known to support channels.
+    /// @param channel the logical channel, 0 is the channel of the original protocol
+    /// @param data the msg buffer to be send
+    /// @param size the size of buffer
+    /// @return the id of message passed to the send completion handler, 0 if nothing is sended
+    uint32_t SendFrame(uint8_t channel, uint8_t* data, int size);
+
+    /// @brief Send data to peer on a logical channel with a priority
+    /// NOTE: The next fragment is always taken from the highest priority waiting, so that urgent
+    /// messages preempt bulk ones at fragment boundaries. On the same channel a message overtakes
+    /// the ones of lower priority not yet started.
+    /// @param channel the logical channel, 0 is the channel of the original protocol
+    /// @param data the msg buffer to be send
+    /// @param size the size of buffer
+    /// @param priority the priority class of message
+    /// @return the id of message passed to the send completion handler, 0 if nothing is sended
+    uint32_t SendFrame(uint8_t channel, uint8_t* data, int size, Priority priority);
+
+    /// @brief Share the link between priority classes instead of strict priority
+    /// @param priority the priority class
+    /// @param weight fragments sended by the class before a lower class waiting gets one,
+    /// 0 (default) to let lower classes wait until the class is empty
+    void SetPriorityWeight(Priority priority, int weight);
+
+    /// @brief Get the statistics of the link
+    /// @return a snapshot of the statistics
+    LinkStats GetStats();
 
     /// @brief Register a callback handler for received connection event
     /// @param handler user provided callback handler function
@@ -61,28 +170,174 @@ class Master {
     /// @param serial_receiver user provided callback handler function
     void SetRecviverHandler(MessageReceivedHandler serial_receiver);
 
+    /// @brief Register a callback handler for the end of sended msg
+    /// NOTE: The handler is called from the work thread with the id returned by SendFrame, the status
+    /// and the latency from SendFrame until the end in us. Only messages sended after it is
+    /// registered are reported.
+    /// @param handler user provided callback handler function
+    void SetSendCompletionHandler(SendCompletionHandler handler);
+
+    /// @brief Register a callback handler for received msg on a logical channel
+    /// NOTE: messages on channel without handler are dropped
+    /// @param channel the logical channel
+    /// @param serial_receiver user provided callback handler function
+    void SetRecviverHandler(uint8_t channel, MessageReceivedHandler serial_receiver);
+
+    /// @brief Call the user handlers on a dispatcher pool instead of the work thread
+    /// NOTE: This function has to be called before start. Received messages, connection events and
+    /// send completions are passed to the pool in order and handled in that order, so that slow
+    /// handlers do not delay the acks of the link. The work thread waits while the pool is full, and
+    /// waits for the handlers pending before CONNECTION_BROKEN is handled. The pool may be shared
+    /// by masters and has to outlive them. A handler may call stop, the handlers posted before
+    /// are done and the ones after it may still run once it returns.
+    /// @param dispatcher the dispatcher pool, NULL to call the handlers from the work thread
+    void SetDispatcher(Dispatcher* dispatcher);
+
+    /// @brief Set the scheduling of the work thread, so that the link is not preempted by other work
+    /// NOTE: This function has to be called before start. The work thread applies the scheduling and
+    /// affinity to itself before it runs the link, start returns once they are applied. Memory locking
+    /// is not per master: it locks every page of the process, current and future, for all its threads
+    /// and masters, and stays until the process ends. Real-time scheduling and memory locking need the
+    /// privilege of system, a setting failed is logged and the link runs without it. On windows
+    /// real-time scheduling maps to the time critical priority and memory locking is not supported.
+    /// @param parameters the settings of the work thread
+    void SetThreadParameters(const ThreadParameters parameters);
+
+    /// @brief Get the settings of the work thread applied by start
+    /// @return bitmask of ThreadSetting
+    int GetThreadSettings();
+
    private:
     /// @brief Main thread function that runs the main loop.
-    void MainThread();
+    /// @param applied set to the ThreadSetting applied to the thread, before the loop starts
+    void MainThread(std::promise<int>* applied);
+
+    /// @brief Apply the thread parameters to the calling thread
+    /// @return bitmask of ThreadSetting applied
+    int ApplyThreadParameters();
+
+    /// @brief Choose the size of user data per i-frame from the observed error rate
+    /// @return the fragment size
+    int FragmentSize();
 
     /// @brief Callback handler function for I-frame
     /// @param parameter provided parameter that is passed to the callback handler
     /// @param msg the msg received by serial
     /// @param size the size of msg
-    /// @param more whether has more data
-    bool DefaultRecviverHandler(uint8_t* msg, int size, bool more);
+    /// @param flags bitmask of IFrameFlag
+    bool DefaultRecviverHandler(uint8_t* msg, int size, int flags);
+
+    /// @brief Compress the message if peer supports it and it gets smaller
+    /// @param data the msg buffer to be send
+    /// @param size the size of buffer
+    /// @param packed the buffer to store the compressed message
+    /// @return bitmask of IFrameFlag describing the message in packed, 0 if it is sended raw
+    int Compress(uint8_t* data, int size, Buffer& packed);
+
+    /// @brief Hand the next fragments of queued messages to the link, one per channel in turn
+    /// NOTE: only as many as the window needs are handed, so that other channels are not blocked
+    void SendFragments();
+
+    /// @brief Choose the priority class to send the next fragment from
+    /// NOTE: channel mutex has to be locked
+    /// @param pending bitmask of the priority classes with waiting messages
+    /// @return the priority class
+    int NextPriority(int pending);
+
+    /// @brief Build the next fragment of the message at the front of channel
+    /// NOTE: channel mutex has to be locked
+    /// @param channel the logical channel
+    /// @param frame_data the buffer to store frame data
+    /// @return the size of frame
+    int PrepareFragment(uint8_t channel, std::vector<uint8_t>& frame_data);
+
+    /// @brief Drop the partial messages after the session with peer is lost
+    /// NOTE: a resumable session goes on with them over a broken link
+    void ResetChannels();
+
+    /// @brief Callback handler function for the end of fragment
+    /// @param id the id of message the fragment belongs to
+    /// @param confirmed whether the fragment was confirmed by peer
+    void ConfirmHandler(uint32_t id, bool confirmed);
+
+    /// @brief Report the end of message to the send completion handler
+    /// @param id the id of message
+    /// @param status the status of message
+    /// @param send_time the time the message was sended by user in us
+    void Complete(uint32_t id, SendStatus status, uint64_t send_time);
 
     /// @brief Callback handler function for U-frame
     /// @param frame frame type
     bool ConnectionHandler(UFrame frame);
 
+   private:
+    struct Message {
+        Buffer data;
+        int flags;  // bitmask of IFrameFlag, set when the first fragment is sended
+        int pos;    // size of data already sended
+        Priority priority;
+        uint32_t id;
+        bool tracked;  // the end is reported to the send completion handler
+    };
+
+    struct Tracking {
+        uint64_t send_time;  // in us
+        int fragments;       // fragments handed to the link
+        int confirmed;       // fragments confirmed by peer
+        bool handed;         // all fragments are handed to the link
+    };
+
+    struct Channel {
+        explicit Channel(MemoryResource* resource) : buffer(resource), discarding(false), messages(resource) {}
+
+        std::shared_ptr<MessageReceivedHandler> receiver;  // shared with the calls running unlocked
+        Buffer buffer;                                      // fragments of the message being received
+        bool discarding;                                    // the message being received is too large and dropped
+        std::list<Message, Allocator<Message>> messages;    // messages to be sended
+    };
+
+    typedef std::map<uint8_t, Channel, std::less<uint8_t>, Allocator<std::pair<const uint8_t, Channel>>> ChannelMap;
+    typedef std::map<uint32_t, Tracking, std::less<uint32_t>, Allocator<std::pair<const uint32_t, Tracking>>> TrackingMap;
+
+    /// @brief Get a channel, it is added if not yet used
+    /// NOTE: channel mutex has to be locked
+    Channel& GetChannel(uint8_t id);
+
    private:
     Frame frame_;
     bool running_;
     std::thread work_;
-    MessageReceivedHandler serial_receiver_;
     ConnectionEventHandler connection_ev_handler_;
-    std::vector<uint8_t> buffer_;
+    Dispatcher* dispatcher_;
+    ThreadParameters thread_parameters_;
+    std::atomic<int> thread_settings_;  // bitmask of ThreadSetting applied
+
+   private:
+    ChannelMap channels_;
+    std::mutex channel_mutex_;
+    uint8_t last_channel_;  // channel of the last fragment sended
+    int priority_weight_[PRIORITY_LEVELS];
+    int priority_credit_[PRIORITY_LEVELS];  // fragments left to the class before a lower one gets its turn
+
+   private:
+    std::shared_ptr<SendCompletionHandler> completion_handler_;  // shared with the calls running unlocked
+    TrackingMap tracking_;
+    uint32_t message_id_;  // id of the last message sended
+
+   private:
+    int fragment_min_;
+    int fragment_max_;
+    std::atomic<int> fragment_size_;
+
+   private:
+    bool compression_;
+    std::vector<uint8_t> dictionary_;
+    Buffer packed_;    // message being compressed, swapped with the data of message
+    Buffer fragment_;  // user data of the fragment being prepared
+    Buffer unpacked_;
+    std::vector<uint8_t> frame_data_;  // i-frame being prepared
+    int message_max_;                  // largest message accepted from peer
+    std::atomic<uint64_t> message_bytes_;
 };
 
 }  // namespace protocol
@@ -0,0 +1,141 @@
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc/crc.h"
+#include "crc/crc_table.h"
+#include "layer.h"
+
+namespace protocol {
+
+/* Fields of frames are little-endian whatever the host is. The bytes are assembled by shifts, compilers merge
+   them into one unaligned load or store, with a byte swap on big-endian targets. */
+
+inline uint16_t LoadLe16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+
+inline uint32_t LoadLe32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void StoreLe16(uint8_t* p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+inline void StoreLe32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+/// @brief Checksum of frames by its width in bits, stored little-endian after the content
+template <int Width>
+struct Checksum;
+
+template <>
+struct Checksum<8> {
+    static const int cLength = 1;
+    static void Store(const uint8_t* content, int len, uint8_t* trailer) { trailer[0] = crc::crc8(content, len); }
+    static bool Check(const uint8_t* content, int len, const uint8_t* trailer) {
+        return crc::crc8(content, len) == trailer[0];
+    }
+};
+
+template <>
+struct Checksum<16> {
+    static const int cLength = 2;
+    static void Store(const uint8_t* content, int len, uint8_t* trailer) { StoreLe16(trailer, crc::crc16(content, len)); }
+    static bool Check(const uint8_t* content, int len, const uint8_t* trailer) {
+        return crc::crc16(content, len) == LoadLe16(trailer);
+    }
+};
+
+template <>
+struct Checksum<32> {
+    static const int cLength = 4;
+    static void Store(const uint8_t* content, int len, uint8_t* trailer) { StoreLe32(trailer, crc::crc32c(content, len)); }
+    static bool Check(const uint8_t* content, int len, const uint8_t* trailer) {
+        return crc::crc32c(content, len) == LoadLe32(trailer);
+    }
+};
+
+/// @brief U-frame of type, the checksum is computed by the compiler
+template <uint8_t Type>
+struct UFrameCodec {
+    static constexpr uint8_t bytes[cUFixedLength] = {cUmark, Type, crc::crc8_byte(0, Type), cEmark};
+};
+
+template <uint8_t Type>
+constexpr uint8_t UFrameCodec<Type>::bytes[cUFixedLength];
+
+enum CodecResult { CODEC_OK,
+                   CODEC_SIZE_ERROR,
+                   CODEC_CHECKSUM_ERROR };
+
+/// @brief Encoder and decoder of the i-frame of mark
+/// NOTE: [mark][size(2)][size(2)][mark][frame no(2)][flags][data][checksum][end], the flags byte is carried by
+/// the extended and the wide i-frame. The layout is resolved at compile time, the i-frame and the extended one
+/// share all but Encode.
+template <uint8_t Mark>
+struct IFrameCodec {
+    static const int cWidth = Mark == cWmark ? 32 : 16;
+    static const int cFlagsLength = Mark == cImark ? 0 : cXFlagsLength;
+    static const int cFixedLength = cIFixedLength - 2 + Checksum<cWidth>::cLength;
+
+    /// @brief Write the frame of data, the frame no and checksum are left to Seal
+    /// @param data data pointer to the user data
+    /// @param size size of the user data
+    /// @param more whether more fragments of the message follow
+    /// @param flags flags of the extended i-frame, ignored by the i-frame
+    /// @param fields bytes left after the flags for the fields filled when sended
+    /// @param frame_data buffer of the frame
+    /// @return size of the frame
+    static int Encode(const uint8_t* data, int size, bool more, uint8_t flags, int fields, uint8_t* frame_data) {
+        size += fields;
+        uint16_t mark_size = (uint16_t)(((size + cFlagsLength) & 0x7fff) | (more ? 0x8000 : 0));
+        frame_data[0] = Mark;
+        StoreLe16(frame_data + 1, mark_size);
+        StoreLe16(frame_data + 3, mark_size);
+        frame_data[5] = Mark;
+        if (cFlagsLength) {
+            frame_data[cIDataOffset] = flags;
+        }
+        memset(frame_data + cIDataOffset + cFlagsLength, 0, fields);
+        memcpy(frame_data + cIDataOffset + cFlagsLength + fields, data, size - fields);
+        frame_data[size + cFlagsLength + cFixedLength - 1] = cEmark;
+        return size + cFlagsLength + cFixedLength;
+    }
+
+    /// @brief Number the frame and fill its checksum
+    /// @param frame_data the frame
+    /// @param size size of the frame
+    /// @param frame_no the frame no
+    static void Seal(uint8_t* frame_data, int size, uint16_t frame_no) {
+        int len = size - cFixedLength + 2;
+        StoreLe16(frame_data + cIHeaderLength, frame_no);
+        Checksum<cWidth>::Store(frame_data + cIHeaderLength, len, frame_data + cIHeaderLength + len);
+    }
+
+    /// @brief Check the size and checksum of a received frame
+    /// @param msg the frame
+    /// @param size size of the frame
+    /// @return CodecResult
+    static int Parse(const uint8_t* msg, int size) {
+        uint16_t mark_size = LoadLe16(msg + 1);
+        if (mark_size != LoadLe16(msg + 3) || size != (mark_size & 0x7fff) + cFixedLength) {
+            return CODEC_SIZE_ERROR;
+        }
+        int len = size - cFixedLength + 2;
+        if (!Checksum<cWidth>::Check(msg + cIHeaderLength, len, msg + cIHeaderLength + len)) {
+            return CODEC_CHECKSUM_ERROR;
+        }
+        return CODEC_OK;
+    }
+};
+
+}  // namespace protocol
+
+#endif
@@ -1,14 +1,13 @@
 #include "frame.h"
 
+#include <math.h>
 #include <string.h>
-#ifdef __linux__
-#include <sys/time.h>
-#else
-#include <Windows.h>
-#endif
 
+#include <random>
+
+#include "codec.h"
 #include "crc/crc.h"
-#include "endian.h"
+#include "fec/fec.h"
 #include "log/log.h"
 
 namespace protocol {
@@ -18,110 +17,317 @@ enum MsgState { STATE_IDLE,
                 STATE_SEND_CONGIRMED,
 };
 
-#define MAX_SIZE 0x4000
 struct sMsg {
+    /// @brief A frame waiting to be sended, with a copy of its bytes
+    sMsg(const uint8_t* frame, int frame_size, uint32_t frame_tag, const Allocator<uint8_t>& allocator)
+        : state(STATE_IDLE), send_time(0), retries(0), frame_no(0), tag(frame_tag), size(frame_size),
+          data(frame, frame + frame_size, allocator) {}
+
     MsgState state;
     uint64_t send_time;
+    int retries;
+    int frame_no;  // 0 until the i-frame is sended at first
+    uint32_t tag;  // reported to the confirm handler, 0 for none
     int size;
-    uint8_t data[MAX_SIZE];
+    Buffer data;
+    Timer timer;  // retransmission of the sended frame
 };
 
 #define FIXED_MSG_SIZE 4
-static uint8_t STARTDT_ACT_MSG[] = {cUmark, START, 0x7, cEmark};
-static uint8_t STARTDT_CON_MSG[] = {cUmark, STARTC, 0xe, cEmark};
-static uint8_t RESETDT_ACT_MSG[] = {cUmark, RESET, 0x1c, cEmark};
-static uint8_t RESETDT_CON_MSG[] = {cUmark, RESETC, 0x38, cEmark};
-static uint8_t STOPDT_ACT_MSG[] = {cUmark, STOP, 0x70, cEmark};
-static uint8_t STOPDT_CON_MSG[] = {cUmark, STOPC, 0xe0, cEmark};
-static uint8_t TESTFR_ACT_MSG[] = {cUmark, TESTFR, 0xc7, cEmark};
-static uint8_t TESTFR_CON_MSG[] = {cUmark, TESTFRC, 0x89, cEmark};
+static const uint8_t* STARTDT_ACT_MSG = UFrameCodec<START>::bytes;
+static const uint8_t* STARTDT_CON_MSG = UFrameCodec<STARTC>::bytes;
+static const uint8_t* RESETDT_ACT_MSG = UFrameCodec<RESET>::bytes;
+static const uint8_t* RESETDT_CON_MSG = UFrameCodec<RESETC>::bytes;
+static const uint8_t* STOPDT_ACT_MSG = UFrameCodec<STOP>::bytes;
+static const uint8_t* STOPDT_CON_MSG = UFrameCodec<STOPC>::bytes;
+static const uint8_t* TESTFR_ACT_MSG = UFrameCodec<TESTFR>::bytes;
+static const uint8_t* TESTFR_CON_MSG = UFrameCodec<TESTFRC>::bytes;
+
+/* capabilities payload: version, flags, frame size(2), window size, crc types, features, fec parity, frame no(2),
+   dictionary id(2), expected frame no(2), session id(2) */
+#define CAPS_VERSION 1
+#define CAPS_SIZE 16
+#define CAPS_MIN_SIZE 12      // without expected frame no and session id
+#define CAPS_FLAG_KNOWN 0x1   // sender has received the capabilities of receiver
+#define CAPS_FLAG_SYNC 0x2    // receiver has to take over the frame number
+#define CAPS_FLAG_RESUME 0x4  // sender resumes the session and waits for the answer of receiver
+
+/* settings of the original protocol, used until the peer has send its capabilities */
+#define LEGACY_FRAME_SIZE 0x1000
+#define DEFAULT_WINDOW_SIZE 8
+#define MAX_WINDOW_SIZE 0x7f
+#define PACING_DELAY 20  // i-frames wait while the serial has more than this in ms to send
+#define POLL_INTERVAL 10  // ms the send queue waits at most while no frame arrives
+
+/* session ids tell a peer keeping its state from a restarted one, 0 is unknown */
+static uint16_t NewSessionId() {
+    static std::random_device random;
+    uint16_t id = 0;
+    while (id == 0) {
+        id = (uint16_t)random();
+    }
+    return id;
+}
+
+/* frame numbers run from 1 to 0xffff */
+static inline int NextFrameNo(int frame_no) {
+    return frame_no % 0xffff + 1;
+}
+
+static inline int FrameNoDistance(int from, int to) {
+    return (to - from + 0xffff) % 0xffff;
+}
+
+#define DEFAULT_RTO_MIN 0.05f
 
 APCIParameters default_apci_parameters = {
     /* .time_alive = */ 15,
-    /* .time_heart = */ 20};
+    /* .time_heart = */ 20,
+    /* .time_rto_min = */ DEFAULT_RTO_MIN,
+    /* .fec_parity = */ 0,
+    /* .fragment_min = */ 0,
+    /* .fragment_max = */ 0,
+    /* .frame_size = */ 0,
+    /* .window_size = */ 0,
+    /* .compression = */ 0,
+    /* .dictionary = */ NULL,
+    /* .dictionary_size = */ 0,
+    /* .resumable = */ 0,
+    /* .crc_type = */ 0,
+    /* .time_ack_delay = */ 0,
+    /* .memory_resource = */ NULL,
+    /* .message_max = */ 0};
 
 Frame::Frame(SerialPortBase* serial_connection) : Frame(serial_connection, default_apci_parameters) {}
 
 Frame::Frame(SerialPortBase* serial_connection, const APCIParameters apci_parameters)
-    : frame_handler_(serial_connection), apci_parameters_(apci_parameters) {
-    ResetAll();
+    : frame_handler_(serial_connection),
+      apci_parameters_(apci_parameters),
+      rtt_estimator_((uint64_t)((apci_parameters.time_rto_min > 0 ? apci_parameters.time_rto_min : DEFAULT_RTO_MIN) * 1000),
+                     (uint64_t)(apci_parameters.time_alive * 1000)),
+      timer_wheel_(MonotonicTimeInMs()),
+      now_(MonotonicTimeInMs()),
+      msg_queue_(Allocator<Msg>(apci_parameters.memory_resource)) {
+    local_caps_.frame_size = LEGACY_FRAME_SIZE;
+    if (apci_parameters.frame_size > 0) {
+        local_caps_.frame_size = apci_parameters.frame_size < cMaxFrameLength ? apci_parameters.frame_size : cMaxFrameLength;
+        if (local_caps_.frame_size <= cIFixedLength) {
+            local_caps_.frame_size = cIFixedLength + 1;
+        }
+    }
+    local_caps_.window_size = DEFAULT_WINDOW_SIZE;
+    if (apci_parameters.window_size > 0) {
+        local_caps_.window_size = apci_parameters.window_size < MAX_WINDOW_SIZE ? apci_parameters.window_size : MAX_WINDOW_SIZE;
+    }
+    // wide i-frames are always checked, they are sended to peer only if both sides set them
+    local_caps_.crc_types = CRC_TYPE_16;
+    if (apci_parameters.crc_type == CRC_TYPE_32C) {
+        local_caps_.crc_types |= CRC_TYPE_32C;
+    }
+    // received messages are always decompressed and demultiplexed, whatever this side sends
+    local_caps_.features = FEATURE_FEC | FEATURE_COMPRESSION | FEATURE_CHANNELS;
+    if (apci_parameters.resumable) {
+        local_caps_.features |= FEATURE_RESUME;
+    }
+    // the frame no expected is always taken from i-frames, it is sended to peer only if both sides delay the ack
+    if (apci_parameters.time_ack_delay > 0) {
+        local_caps_.features |= FEATURE_ACK;
+    }
+    local_caps_.fec_parity = apci_parameters.fec_parity > 0 ? (apci_parameters.fec_parity < fec::cMaxNsym ? apci_parameters.fec_parity : fec::cMaxNsym) : 0;
+    local_caps_.dictionary_id = 0;
+    if (apci_parameters.dictionary != NULL && apci_parameters.dictionary_size > 0) {
+        local_caps_.dictionary_id = crc::crc16(apci_parameters.dictionary, apci_parameters.dictionary_size);
+        if (local_caps_.dictionary_id == 0) {
+            local_caps_.dictionary_id = 1;
+        }
+    }
+    memset(&peer_caps_, 0, sizeof(peer_caps_));
+    peer_caps_valid_ = false;
+    peer_knows_caps_ = false;
+    caps_flag_sended_ = false;
+
+    memset(&stats_, 0, sizeof(stats_));
+    attempt_count_ = 0;
+    attempt_bytes_ = 0;
+    success_count_ = 0;
+
+    heart_timer_.SetHandler([this]() { return HandleHeartbeat(); });
+    ack_timer_.SetHandler([this]() { return SendAck(cKmark); });
+    ResetTimeout();
+    no_confirm_msg_ = 0;
+    ack_pending_ = 0;
+    send_frame_no_ = 1;
+    recv_frame_no_ = 0;
+    recv_synced_ = false;
+    nak_ignore_ = 0;
+    resuming_ = false;
+    resume_time_ = 0;
+    reset_ = false;
+    session_id_ = NewSessionId();
+    peer_session_id_ = 0;
 }
 
 Frame::~Frame() { msg_queue_.clear(); }
 
 void Frame::MessageHandler(void* parameter, uint8_t* msg, int size) {
-    int crc_flg = 0;
-    uint8_t* content = 0;
-    int len = 0;
-    if (msg[0] == cImark) {
+    Frame* frame = (Frame*)parameter;
+    int result = CODEC_OK;
+    frame->recv_error_ = true;
+    if (msg[0] == cWmark) {
         qDebug << "recv I frame!";
-        if (*(uint16_t*)&msg[1] != *(uint16_t*)&msg[3]) {
+        result = IFrameCodec<cWmark>::Parse(msg, size);
+    } else if (IsIFrameMark(msg[0])) {
+        qDebug << "recv I frame!";
+        result = IFrameCodec<cImark>::Parse(msg, size);
+    } else if (msg[0] == cUmark) {
+        qDebug << "recv U frame!";
+        result = Checksum<8>::Check(msg + 1, 1, msg + size - 2) ? CODEC_OK : CODEC_CHECKSUM_ERROR;
+    } else if (msg[0] == cNmark || msg[0] == cKmark) {
+        qDebug << "recv " << (msg[0] == cNmark ? "Nak" : "Ack") << " frame!";
+        result = Checksum<8>::Check(msg + 1, 2, msg + size - 2) ? CODEC_OK : CODEC_CHECKSUM_ERROR;
+    } else if (msg[0] == cCmark) {
+        qDebug << "recv capabilities frame!";
+        /* payload and checksum are sended as nibbles 0x40-0x4f, decode in place */
+        int len = msg[1];
+        if (size != len + 3 || len % 2 || len < 4) {
             qWarning << "frame size miss!";
             return;
         }
-
-        /* check if message size is reasonable */
-        uint16_t msg_size = (cint16(msg[1], msg[2])) & 0x7fff;
-        if (size != msg_size + cIFixedLength) {
-            qWarning << "frame size miss!";
-            return;
+        for (int i = 0; i < len; i++) {
+            if ((msg[2 + i] & 0xf0) != 0x40) {
+                qWarning << "frame checksum error!";
+                return;
+            }
         }
-
-        content = msg + cIHeaderLength;
-        len = msg_size + 2;
-        crc_flg = 16;
-    } else if (msg[0] == cUmark) {
-        qDebug << "recv U frame!";
-        content = msg + 1;
-        len = 1;
-        crc_flg = 8;
+        len /= 2;
+        for (int i = 0; i < len; i++) {
+            msg[2 + i] = ((msg[2 + 2 * i] & 0xf) << 4) | (msg[3 + 2 * i] & 0xf);
+        }
+        len -= 2;
+        msg[1] = (uint8_t)len;
+        result = Checksum<16>::Check(msg + 2, len, msg + 2 + len) ? CODEC_OK : CODEC_CHECKSUM_ERROR;
     } else if (msg[0] == cAmark) {
         qDebug << "recv Ack frame!";
-        crc_flg = 0;
     } else {
         return;
     }
 
-    /* check checksum */
-    switch (crc_flg) {
-        case 8: {
-            uint8_t checksum = crc::crc8(content, len);
-            if (checksum != msg[size - 2]) {
-                qWarning << "frame checksum error!";
-                return;
-            }
+    if (result == CODEC_SIZE_ERROR) {
+        qWarning << "frame size miss!";
+        return;
+    }
+    if (result == CODEC_CHECKSUM_ERROR) {
+        qWarning << "frame checksum error!";
+        return;
+    }
 
-            /* U-frame ACK */
-        } break;
-        case 16: {
-            uint16_t checksum = crc::crc16(content, len);
-            if (checksum != cint16(msg[size - 3], msg[size - 2])) {
-                qWarning << "frame checksum error!";
-                return;
-            }
+    frame->recv_error_ = false;
+}
 
-        } break;
-        default:
-            break;
+bool Frame::Run() {
+    bool alive = RunOnce();
+
+    // the two lists swap, so that both keep their capacity
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        reporting_.swap(completions_);
+    }
+    if (confirm_handler_) {
+        for (size_t i = 0; i < reporting_.size(); i++) {
+            confirm_handler_(reporting_[i].first, reporting_[i].second);
+        }
+    }
+    reporting_.clear();
+
+    bool reset;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        reset = reset_;
+        reset_ = false;
     }
+    if (reset && reset_handler_) {
+        reset_handler_();
+    }
+    return alive;
 }
 
-bool Frame::Run() {
-    uint8_t buffer[MAX_SIZE] = {0};
-    bool alive = frame_handler_.ReadNextMessage(buffer, Frame::MessageHandler, nullptr);
+bool Frame::RunOnce() {
+    recv_error_ = false;
+    // wake up at the next deadline, or when the send queue is looked at again
+    uint64_t deadline = timer_wheel_.NextDeadline();
+    uint64_t now = MonotonicTimeInMs();
+    frame_handler_.SetMessageTimeout(deadline > now ? (int)(deadline - now < POLL_INTERVAL ? deadline - now : POLL_INTERVAL) : 0);
+    bool alive = frame_handler_.ReadNextMessage(recv_buffer_, Frame::MessageHandler, this);
+    // the clock is read once per run, the deadlines and samples of this run take it
+    now_ = MonotonicTimeInMs();
+
+    // the frames arrived with the first one are handled before anything is sended, a burst of acks opens
+    // the window once
+    bool received = alive;
+    while (alive) {
+        if (!HandleMessage(recv_buffer_)) {
+            return false;
+        }
+        recv_error_ = false;
+        alive = frame_handler_.ReadNextMessage(recv_buffer_, Frame::MessageHandler, this, false);
+    }
+
+    // when receive any frame, reset next heart time
+    if (received) {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        ResetTimeout();
+        no_confirm_msg_ = 0;
+    }
+
+    if (!HandleTimeout()) {
+        ResetAll();
+        return false;
+    }
+
+    if (msg_queue_.size() || resuming_) {
+        if (!SendSingleMessage()) {
+            ResetAll();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Frame::HandleMessage(uint8_t* buffer) {
+    if (recv_error_) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stats_.frames_corrupted++;
+        }
+        // ask for the corrupted i-frame at once instead of waiting for the peer timeout
+        if (IsIFrameMark(buffer[0]) && !SendNak()) {
+            ResetAll();
+            return false;
+        }
+        buffer[0] = 0;
+    }
+
     switch (buffer[0]) {
         /* handle u-frame */
         case cUmark:
             switch (buffer[1]) {
-                case START:
+                case START: {
                     frame_handler_.SendSingleMessage(STARTDT_CON_MSG, FIXED_MSG_SIZE);
+                    std::lock_guard<std::mutex> lock(queue_mutex_);
+                    SendCapabilities(true);
                     qDebug << "confirmed start frame!";
-                    break;
-                case RESET:
+                } break;
+                case RESET: {
                     frame_handler_.SendSingleMessage(RESETDT_CON_MSG, FIXED_MSG_SIZE);
-                    recv_frame_no_ = 0;
+                    // a resumable session keeps counting, the capabilities tell where it goes on
+                    std::lock_guard<std::mutex> lock(queue_mutex_);
+                    if (!Resumable()) {
+                        recv_frame_no_ = 0;
+                        recv_synced_ = true;
+                    }
                     qDebug << "confirmed reset frame!";
-                    break;
+                } break;
                 case STOP:
                     frame_handler_.SendSingleMessage(STOPDT_CON_MSG, FIXED_MSG_SIZE);
                     qDebug << "confirmed stop frame!";
@@ -136,8 +342,10 @@ bool Frame::Run() {
                     qDebug << "recv U confirmed frame!";
                     std::lock_guard<std::mutex> lock(queue_mutex_);
                     auto it = msg_queue_.begin();
-                    if (it->data[1] == (buffer[1] >> 1)) {
-                        msg_queue_.erase(msg_queue_.begin());
+                    if (it != msg_queue_.end() && it->state == STATE_SENDED &&
+                        it->data[1] == (buffer[1] >> 1)) {
+                        ConfirmFrame(it);
+                        msg_queue_.erase(it);
                     }
                 } break;
                 case TESTFRC:
@@ -152,150 +360,595 @@ bool Frame::Run() {
 
             break;
         /* handle i-frame */
-        case cImark: {
-            uint16_t recv_frame_no = *(uint16_t*)(buffer + cIHeaderLength);
-            if (recv_frame_no_ > recv_frame_no) {
-                qError << "frame number error!";
+        case cImark:
+        case cXmark:
+        case cWmark:
+            if (!HandleIFrame(buffer)) {
                 ResetAll();
                 return false;
-            } else if (recv_frame_no_ < recv_frame_no) {
-                if (i_handler_) {
-                    uint16_t msg_size = cint16(buffer[1], buffer[2]);
-                    i_handler_(buffer + cIDataOffset, msg_size & 0x7fff,
-                               msg_size >> 0xF);
-                }
-                recv_frame_no_ = recv_frame_no % 0xffff;
             }
-
-            if (!frame_handler_.SendSingleMessage((uint8_t*)&cAmark, 1)) {
+            break;
+        /* handle sequenced ack and nak, only sended by peer knowing our capabilities */
+        case cKmark:
+        case cNmark: {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            peer_knows_caps_ = true;
+            if (buffer[0] == cKmark) {
+                HandleAck(LoadLe16(buffer + 1));
+            } else {
+                HandleNak(LoadLe16(buffer + 1));
+            }
+        } break;
+        /* handle capabilities */
+        case cCmark: {
+            bool handled;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                handled = HandleCapabilities(buffer + 2, buffer[1]);
+            }
+            if (!handled) {
                 ResetAll();
                 return false;
             }
-            qDebug << "send Ack frame at " << recv_frame_no_;
         } break;
         /* handle ack */
         case cAmark: {
             std::lock_guard<std::mutex> lock(queue_mutex_);
             if (msg_queue_.size() && msg_queue_.begin()->state == STATE_SENDED) {
+                ConfirmFrame(msg_queue_.begin());
+                Complete(msg_queue_.begin(), true);
                 msg_queue_.erase(msg_queue_.begin());
-                if (send_frame_no_ >= 0xffff) {
-                    send_frame_no_ = 0;
-                }
-                send_frame_no_++;
             }
         } break;
         default:
             break;
     }
+    return true;
+}
 
-    // when receive any frame, reset next heart time
-    if (alive) {
-        ResetTimeout();
-        no_confirm_msg_ = 0;
+bool Frame::HandleIFrame(uint8_t* buffer) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        stats_.frames_received++;
     }
 
-    if (msg_queue_.size()) {
-        if (!SendSingleMessage()) {
-            ResetAll();
+    uint16_t msg_size = LoadLe16(buffer + 1);
+    uint16_t recv_frame_no = LoadLe16(buffer + cIHeaderLength);
+    bool piggyback = buffer[0] != cImark && (buffer[cIDataOffset] & IFRAME_ACK);
+    if (piggyback && (msg_size & 0x7fff) < cXFlagsLength + cXAckLength) {
+        qWarning << "frame size miss!";
+        return true;
+    }
+    if (piggyback) {
+        // the frame no expected by peer confirms our frames, whatever happens to this one
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        peer_knows_caps_ = true;
+        HandleAck(LoadLe16(buffer + cIDataOffset + cXFlagsLength));
+    }
+
+    bool accept = false;
+    if (!peer_caps_valid_) {
+        // original protocol, any newer frame is taken
+        if (recv_frame_no_ > recv_frame_no) {
+            qError << "frame number error!";
             return false;
         }
+        accept = recv_frame_no_ < recv_frame_no;
+    } else {
+        // only the expected frame is taken, frames in window before it are duplicates
+        // and frames in window after it tell that the expected one is lost
+        int window = local_caps_.window_size;
+        int distance = FrameNoDistance(NextFrameNo(recv_frame_no_), recv_frame_no);
+        if (!recv_synced_ || distance == 0) {
+            accept = true;
+        } else if (distance <= window) {
+            qDebug << "frame lost before " << recv_frame_no;
+            return SendNak();
+        } else if (distance < 0xffff - window) {
+            qWarning << "frame number resync at " << recv_frame_no;
+            accept = true;
+        }
     }
 
-    if (!HandleTimeout()) {
-        ResetAll();
+    if (accept && i_handler_) {
+        uint8_t* data = buffer + cIDataOffset;
+        int size = msg_size & 0x7fff;
+        int flags = (msg_size >> 0xF) ? IFRAME_MORE : 0;
+        if (buffer[0] != cImark) {
+            flags |= data[0] & ~(IFRAME_MORE | IFRAME_ACK);
+            data += cXFlagsLength;
+            size -= cXFlagsLength;
+        }
+        if (piggyback) {
+            data += cXAckLength;
+            size -= cXAckLength;
+        }
+        i_handler_(data, size, flags);
+    }
+
+    if (accept) {
+        recv_frame_no_ = recv_frame_no % 0xffff;
+        recv_synced_ = true;
+    }
+
+    if (peer_caps_valid_) {
+        return AckIFrame();
+    }
+
+    if (!frame_handler_.SendSingleMessage((uint8_t*)&cAmark, 1)) {
         return false;
     }
+    qDebug << "send Ack frame at " << recv_frame_no_;
+    return true;
+}
 
+bool Frame::AckIFrame() {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    Capabilities caps = Negotiate();
+    if (!(caps.features & FEATURE_ACK) || ++ack_pending_ * 2 >= caps.window_size) {
+        return SendAck(cKmark);
+    }
+    // the delay runs from the first frame not yet acknowledged
+    if (!ack_timer_.is_scheduled()) {
+        timer_wheel_.Schedule(&ack_timer_, now_ + (uint64_t)(apci_parameters_.time_ack_delay * 1000));
+    }
     return true;
 }
 
-void Frame::ResetAll() {
-    ResetTimeout();
-    no_confirm_msg_ = 0;
-    send_frame_no_ = 1;
-    recv_frame_no_ = 0;
-    msg_queue_.clear();
+bool Frame::SendAck(uint8_t mark) {
+    int expect_frame_no = NextFrameNo(recv_frame_no_);
+    uint8_t ack[cKFixedLength] = {mark, 0, 0, 0, cEmark};
+    StoreLe16(ack + 1, (uint16_t)expect_frame_no);
+    Checksum<8>::Store(ack + 1, 2, ack + 3);
+    timer_wheel_.Cancel(&ack_timer_);
+    ack_pending_ = 0;
+    qDebug << "send " << (mark == cNmark ? "Nak" : "Ack") << " frame at " << expect_frame_no;
+    return frame_handler_.SendSingleMessage(ack, cKFixedLength);
 }
 
-static uint64_t Hal_getTimeInMs() {
-#ifdef __linux__
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    return ((uint64_t)now.tv_sec * 1000LL) + (now.tv_usec / 1000);
-#else
-    FILETIME ft;
-    uint64_t now;
-    static const uint64_t DIFF_TO_UNIXTIME = 11644473600000ULL;
-    GetSystemTimeAsFileTime(&ft);
-    now = (LONGLONG)ft.dwLowDateTime + ((LONGLONG)(ft.dwHighDateTime) << 32LL);
-    return (now / 10000LL) - DIFF_TO_UNIXTIME;
-#endif
+bool Frame::SendNak() {
+    // nak is unknown to the original protocol
+    if (!peer_caps_valid_) {
+        return true;
+    }
+
+    return SendAck(cNmark);
 }
 
-void Frame::ResetTimeout() {
-    next_heart_timeout_ = Hal_getTimeInMs() + (uint64_t)(apci_parameters_.time_heart * 1000);
+void Frame::HandleAck(uint16_t expect_frame_no) {
+    while (msg_queue_.size()) {
+        auto it = msg_queue_.begin();
+        if (!IsIFrameMark(it->data[0]) || it->frame_no == 0) {
+            break;
+        }
+
+        int distance = FrameNoDistance(it->frame_no, expect_frame_no);
+        if (distance == 0 || distance > MAX_WINDOW_SIZE) {
+            break;
+        }
+
+        if (it->state == STATE_SENDED) {
+            ConfirmFrame(it);
+        }
+        Complete(it, true);
+        msg_queue_.erase(it);
+        nak_ignore_ = 0;
+    }
 }
 
-bool Frame::HandleTimeout() {
-    uint64_t currentTime = Hal_getTimeInMs();
-    if (currentTime > next_heart_timeout_) {
-        if (no_confirm_msg_ > 2) {  // testfr frame not confirm
-            qError << "heart timeout overflow!";
-            return false;
-        } else {  // send frame to testfr
-            qDebug << "send heart again!";
-            if (!frame_handler_.SendSingleMessage(TESTFR_ACT_MSG, FIXED_MSG_SIZE))
-                return false;
-            ResetTimeout();
-            no_confirm_msg_++;
+void Frame::HandleNak(uint16_t expect_frame_no) {
+    // frames before the expected one are confirmed by nak too
+    HandleAck(expect_frame_no);
+
+    auto it = msg_queue_.begin();
+    if (it != msg_queue_.end() && IsIFrameMark(it->data[0]) &&
+        it->state == STATE_SENDED && it->frame_no == expect_frame_no) {
+        // the frames in flight behind the lost one are naked too, go back once for all of them
+        if (nak_ignore_ > 0) {
+            nak_ignore_--;
+            return;
         }
+        qWarning << "i frame retransmit on nak at " << expect_frame_no;
+        nak_ignore_ = GoBack(it) - 1;
     }
+}
 
-    if (msg_queue_.size()) {
-        std::lock_guard<std::mutex> lock_queue(queue_mutex_);
-        auto it = msg_queue_.begin();
-        if (it->state == STATE_SENDED && currentTime > it->send_time) {
-            // data frame not confirm along with alive time
-            if (currentTime - it->send_time >= (uint64_t)(apci_parameters_.time_alive * 1000)) {
-                if (!frame_handler_.SendSingleMessage(it->data, it->size))
-                    return false;
-                qWarning << "i frame send unconfirmed!";
-                it->send_time = currentTime;
-                return true;
+int Frame::GoBack(std::list<Msg, Allocator<Msg>>::iterator it) {
+    int count = 0;
+    for (; it != msg_queue_.end(); ++it, ++count) {
+        if (it->state != STATE_SENDED) {
+            break;
+        }
+        it->state = STATE_IDLE;
+        it->retries++;
+        // only the first one is known to be lost, the following are sended again anyway
+        if (count == 0 && IsIFrameMark(it->data[0])) {
+            RecordAttempt(it->size, false);
+        }
+    }
+    return count;
+}
+
+bool Frame::SendCapabilities(bool sync) {
+    // the frame number expected by peer, the first unconfirmed frame
+    int frame_no = send_frame_no_;
+    for (auto it = msg_queue_.begin(); it != msg_queue_.end(); ++it) {
+        if (IsIFrameMark(it->data[0]) && it->frame_no != 0) {
+            frame_no = it->frame_no;
+            break;
+        }
+    }
+
+    uint8_t payload[CAPS_SIZE + 2];
+    payload[0] = CAPS_VERSION;
+    payload[1] = (peer_caps_valid_ ? CAPS_FLAG_KNOWN : 0) | (sync ? CAPS_FLAG_SYNC : 0);
+    if (resuming_) {
+        payload[1] |= CAPS_FLAG_RESUME;
+    }
+    StoreLe16(payload + 2, local_caps_.frame_size);
+    payload[4] = local_caps_.window_size;
+    payload[5] = local_caps_.crc_types;
+    payload[6] = local_caps_.features;
+    payload[7] = local_caps_.fec_parity;
+    StoreLe16(payload + 8, (uint16_t)frame_no);
+    StoreLe16(payload + 10, local_caps_.dictionary_id);
+    int expect_frame_no = recv_synced_ ? NextFrameNo(recv_frame_no_) : 0;
+    StoreLe16(payload + 12, (uint16_t)expect_frame_no);
+    StoreLe16(payload + 14, session_id_);
+    Checksum<16>::Store(payload, CAPS_SIZE, payload + CAPS_SIZE);
+
+    // nibbles never look like a frame begin to the original protocol
+    uint8_t frame[(CAPS_SIZE + 2) * 2 + 3];
+    frame[0] = cCmark;
+    frame[1] = (CAPS_SIZE + 2) * 2;
+    for (int i = 0; i < CAPS_SIZE + 2; i++) {
+        frame[2 + 2 * i] = 0x40 | (payload[i] >> 4);
+        frame[3 + 2 * i] = 0x40 | (payload[i] & 0xf);
+    }
+    frame[sizeof(frame) - 1] = cEmark;
+
+    caps_flag_sended_ = peer_caps_valid_;
+    if (resuming_) {
+        resume_time_ = now_;
+    }
+    qDebug << "send capabilities frame!";
+    return frame_handler_.SendSingleMessage(frame, sizeof(frame));
+}
+
+bool Frame::HandleCapabilities(uint8_t* payload, int size) {
+    if (size < CAPS_MIN_SIZE || payload[0] < CAPS_VERSION) {
+        return true;
+    }
+
+    Capabilities caps;
+    caps.frame_size = LoadLe16(payload + 2);
+    caps.window_size = payload[4];
+    caps.crc_types = payload[5];
+    caps.features = payload[6];
+    caps.fec_parity = payload[7] < fec::cMaxNsym ? payload[7] : fec::cMaxNsym;
+    caps.dictionary_id = LoadLe16(payload + 10);
+    if (caps.frame_size <= cIFixedLength || caps.window_size == 0 || !(caps.crc_types & CRC_TYPE_16)) {
+        qWarning << "capabilities invalid!";
+        return true;
+    }
+
+    // the state kept belongs to the session with the peer known before
+    bool session = Resumable() && peer_session_id_ != 0;
+    uint16_t session_id = size >= CAPS_SIZE ? LoadLe16(payload + 14) : 0;
+    peer_caps_ = caps;
+    peer_caps_valid_ = true;
+    peer_knows_caps_ = (payload[1] & CAPS_FLAG_KNOWN) != 0;
+
+    bool resume = false;
+    if (session && session_id != peer_session_id_) {
+        // peer has lost the session, restarted or does not resume any more
+        qWarning << "session lost!";
+        DropSession();
+        recv_synced_ = false;
+    } else if (session && (resuming_ || (payload[1] & CAPS_FLAG_RESUME))) {
+        // the frames before the one expected by peer have arrived, send the others again
+        int expect_frame_no = LoadLe16(payload + 12);
+        if (expect_frame_no) {
+            HandleAck(expect_frame_no);
+        }
+        for (auto it = msg_queue_.begin(); it != msg_queue_.end(); ++it) {
+            if (it->state == STATE_SENDED && IsIFrameMark(it->data[0])) {
+                it->state = STATE_IDLE;
+                it->retries++;
             }
         }
+        nak_ignore_ = 0;
+        resume = true;
+        qInfo << "session resumed at " << expect_frame_no;
+    }
+    resuming_ = false;
+    peer_session_id_ = session_id;
+
+    // the receive state is kept by a resumed session
+    if ((payload[1] & CAPS_FLAG_SYNC) && !resume) {
+        int frame_no = LoadLe16(payload + 8);
+        recv_frame_no_ = (frame_no + 0xfffe) % 0xffff;
+        recv_synced_ = true;
     }
 
+    Capabilities negotiated = Negotiate();
+    frame_handler_.SetFec(negotiated.fec_parity);
+    qInfo << "negotiated frame size " << negotiated.frame_size << ", window size " << (int)negotiated.window_size
+          << ", fec parity " << (int)negotiated.fec_parity;
+
+    // answer until both sides know that the other one has the capabilities, and to peer resuming
+    if (!peer_knows_caps_ || !caps_flag_sended_ || (payload[1] & CAPS_FLAG_RESUME)) {
+        return SendCapabilities(false);
+    }
+    return true;
+}
+
+Capabilities Frame::Negotiate() {
+    Capabilities caps = {LEGACY_FRAME_SIZE, 1, CRC_TYPE_16, 0, 0, 0};
+    if (!peer_caps_valid_) {
+        return caps;
+    }
+
+    caps.frame_size = local_caps_.frame_size < peer_caps_.frame_size ? local_caps_.frame_size : peer_caps_.frame_size;
+    // frames in flight need the peer to know that we take the sequenced ack
+    if (peer_knows_caps_) {
+        caps.window_size = local_caps_.window_size < peer_caps_.window_size ? local_caps_.window_size : peer_caps_.window_size;
+    }
+    caps.crc_types = local_caps_.crc_types & peer_caps_.crc_types;
+    caps.features = local_caps_.features & peer_caps_.features;
+    if (caps.features & FEATURE_FEC) {
+        caps.fec_parity = local_caps_.fec_parity > peer_caps_.fec_parity ? local_caps_.fec_parity : peer_caps_.fec_parity;
+    }
+    if ((caps.features & FEATURE_COMPRESSION) && local_caps_.dictionary_id == peer_caps_.dictionary_id) {
+        caps.dictionary_id = local_caps_.dictionary_id;
+    }
+    return caps;
+}
+
+Capabilities Frame::GetCapabilities() {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    return Negotiate();
+}
+
+bool Frame::Resumable() {
+    return (Negotiate().features & FEATURE_RESUME) != 0;
+}
+
+void Frame::DropSession() {
+    // continue far away from the old frame number, so that the peer takes it as a resync
+    // instead of duplicates, the original protocol expects to restart from the first
+    send_frame_no_ = peer_caps_valid_ ? NextFrameNo(send_frame_no_ + 0x7fff) : 1;
+    nak_ignore_ = 0;
+    resuming_ = false;
+    reset_ = true;
+    // the peer keeping its state has to notice that it is gone
+    session_id_ = NewSessionId();
+    for (auto it = msg_queue_.begin(); it != msg_queue_.end(); ++it) {
+        Complete(it, false);
+    }
+    msg_queue_.clear();
+}
+
+void Frame::ResetAll() {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    ResetTimeout();
+    no_confirm_msg_ = 0;
+    timer_wheel_.Cancel(&ack_timer_);
+    ack_pending_ = 0;
+    if (Resumable()) {
+        // keep the i-frames to be sended again from where the peer tells, u-frames are up to the user
+        for (auto it = msg_queue_.begin(); it != msg_queue_.end();) {
+            if (!IsIFrameMark(it->data[0])) {
+                it = msg_queue_.erase(it);
+                continue;
+            }
+            if (it->state == STATE_SENDED) {
+                it->state = STATE_IDLE;
+                it->retries++;
+            }
+            ++it;
+        }
+        nak_ignore_ = 0;
+        resuming_ = true;
+        resume_time_ = 0;
+        // the timeout backed off on the broken link says nothing about the next one
+        rtt_estimator_.Restore();
+        qInfo << "session kept for resumption";
+        return;
+    }
+
+    DropSession();
+    recv_frame_no_ = 0;
+    recv_synced_ = false;
+}
+
+void Frame::ResetTimeout() {
+    timer_wheel_.Schedule(&heart_timer_, now_ + (uint64_t)(apci_parameters_.time_heart * 1000));
+}
+
+bool Frame::HandleTimeout() {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    return timer_wheel_.Expire(now_);
+}
+
+bool Frame::HandleHeartbeat() {
+    if (no_confirm_msg_ > 2) {  // testfr frame not confirm
+        qError << "heart timeout overflow!";
+        return false;
+    }
+    // send frame to testfr
+    qDebug << "send heart again!";
+    if (!frame_handler_.SendSingleMessage(TESTFR_ACT_MSG, FIXED_MSG_SIZE)) {
+        return false;
+    }
+    ResetTimeout();
+    no_confirm_msg_++;
+    return true;
+}
+
+void Frame::ArmRetransmit(std::list<Msg, Allocator<Msg>>::iterator it) {
+    it->timer.SetHandler([this, it]() { return HandleRetransmit(it); });
+    timer_wheel_.Schedule(&it->timer, it->send_time + rtt_estimator_.rto());
+}
+
+bool Frame::HandleRetransmit(std::list<Msg, Allocator<Msg>>::iterator it) {
+    if (it->state != STATE_SENDED) {
+        return true;
+    }
+    // the timeout may have grown since the frame was sended
+    uint64_t deadline = it->send_time + rtt_estimator_.rto();
+    if (now_ < deadline) {
+        timer_wheel_.Schedule(&it->timer, deadline);
+        return true;
+    }
+    // frame not confirm within retransmission timeout, send it and the following again
+    qWarning << "frame send unconfirmed!";
+    GoBack(it);
+    nak_ignore_ = 0;
+    rtt_estimator_.Backoff();
     return true;
 }
 
 void Frame::SendFrame(uint8_t* data, int size) {
+    SendFrame(data, size, 0);
+}
+
+void Frame::SendFrame(uint8_t* data, int size, uint32_t tag) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    msg_queue_.emplace_back(data, size, tag, msg_queue_.get_allocator());
+}
+
+void Frame::Complete(std::list<Msg, Allocator<Msg>>::iterator it, bool confirmed) {
+    if (it->tag) {
+        completions_.push_back(std::make_pair(it->tag, confirmed));
+    }
+}
+
+int Frame::QueuedFrames() {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    return (int)msg_queue_.size();
+}
+
+void Frame::ConfirmFrame(std::list<Msg, Allocator<Msg>>::iterator it) {
+    // Karn's rule, the confirm of a retransmitted frame is ambiguous
+    if (it->retries == 0 && now_ >= it->send_time) {
+        rtt_estimator_.Sample(now_ - it->send_time);
+        qDebug << "rtt sample " << now_ - it->send_time << ", rto = " << rtt_estimator_.rto();
+    }
+
+    if (IsIFrameMark(it->data[0])) {
+        RecordAttempt(it->size, true);
+        stats_.frames_confirmed++;
+    }
+}
+
+void Frame::RecordAttempt(int size, bool success) {
+    attempt_count_ = attempt_count_ * 15 / 16 + 1;
+    attempt_bytes_ = attempt_bytes_ * 15 / 16 + size;
+    success_count_ = success_count_ * 15 / 16 + (success ? 1 : 0);
+}
+
+LinkStats Frame::GetStats() {
     std::lock_guard<std::mutex> lock(queue_mutex_);
-    sMsg frame = {STATE_IDLE, 0, size, 0};
-    memcpy(frame.data, data, size);
-    msg_queue_.emplace_back(frame);
+    LinkStats stats = stats_;
+    stats.frames_corrupted += frame_handler_.decode_errors();
+    stats.byte_error_rate = 0;
+    if (attempt_count_ > 0 && success_count_ < attempt_count_) {
+        // a frame of L bytes survives with (1 - p) ^ L
+        double survival = success_count_ / attempt_count_;
+        double size = attempt_bytes_ / attempt_count_;
+        stats.byte_error_rate = survival > 0 ? 1 - pow(survival, 1 / size) : 1;
+    }
+    stats.srtt = rtt_estimator_.srtt();
+    stats.rto = rtt_estimator_.rto();
+    return stats;
 }
 
 bool Frame::SendSingleMessage() {
     std::lock_guard<std::mutex> lock(queue_mutex_);
-    auto it = msg_queue_.begin();
-    if (it->state == STATE_IDLE) {
-        if (it->data[0] == cImark) {
-            uint8_t* frame_data = it->data;
-            memcpy(frame_data + cIHeaderLength, &send_frame_no_, sizeof(uint16_t));
-            uint16_t crc_size = it->size - cIFixedLength + 2;
-            uint16_t check_sum = crc::crc16(frame_data + cIHeaderLength, crc_size);
-            memcpy(frame_data + cIHeaderLength + crc_size, &check_sum, sizeof(uint16_t));
-            qDebug << "send I frame at " << send_frame_no_;
-        } else {
+    // ask peer for the frame it expects until it answers
+    if (resuming_ && now_ - resume_time_ >= rtt_estimator_.rto() && !SendCapabilities(false)) {
+        return false;
+    }
+
+    int window = Negotiate().window_size;
+    int in_flight = 0;
+    for (auto it = msg_queue_.begin(); it != msg_queue_.end(); ++it) {
+        bool iframe = IsIFrameMark(it->data[0]);
+        if (it->state == STATE_SENDED) {
+            // u-frame has to be confirmed before anything else
+            if (!iframe) {
+                break;
+            }
+            in_flight++;
+            continue;
+        }
+
+        if (!iframe) {
+            // u-frame waits until the frames before it are confirmed
+            if (it != msg_queue_.begin()) {
+                break;
+            }
+
             qDebug << "send U frame!";
+            if (!frame_handler_.SendSingleMessage(it->data.data(), it->size)) {
+                return false;
+            }
+            if (it->data[1] == START && !SendCapabilities(true)) {
+                return false;
+            } else if (it->data[1] == RESET && !Resumable()) {
+                // peer expects the first frame number after reset
+                send_frame_no_ = 1;
+            }
+            it->state = STATE_SENDED;
+            it->send_time = now_ + frame_handler_.OutputDelay();
+            ArmRetransmit(it);
+            break;
+        }
+
+        if (in_flight >= window || resuming_) {
+            break;
+        }
+
+        // the frames left in queue go after the acks and u-frames sended meanwhile
+        if (frame_handler_.OutputDelay() > PACING_DELAY) {
+            break;
         }
 
-        if (!frame_handler_.SendSingleMessage(it->data, it->size)) {
+        // the frame no expected from peer is the latest whenever the frame is sended, the checksum follows it
+        uint8_t* frame_data = it->data.data();
+        bool piggyback = frame_data[0] != cImark && (frame_data[cIDataOffset] & IFRAME_ACK);
+        if (piggyback) {
+            StoreLe16(frame_data + cIDataOffset + cXFlagsLength, (uint16_t)NextFrameNo(recv_frame_no_));
+            timer_wheel_.Cancel(&ack_timer_);
+            ack_pending_ = 0;
+        }
+        if (it->frame_no == 0 || piggyback) {
+            if (it->frame_no == 0) {
+                it->frame_no = send_frame_no_;
+                send_frame_no_ = NextFrameNo(send_frame_no_);
+            }
+            if (frame_data[0] == cWmark) {
+                IFrameCodec<cWmark>::Seal(frame_data, it->size, (uint16_t)it->frame_no);
+            } else {
+                IFrameCodec<cImark>::Seal(frame_data, it->size, (uint16_t)it->frame_no);
+            }
+        }
+
+        qDebug << "send I frame at " << it->frame_no;
+        if (!frame_handler_.SendSingleMessage(it->data.data(), it->size)) {
             return false;
         }
+        stats_.frames_sent++;
+        stats_.bytes_sent += it->size;
+        if (it->retries) {
+            stats_.frames_retransmit++;
+        }
         it->state = STATE_SENDED;
-        it->send_time = Hal_getTimeInMs();
+        // time out from the moment the frame leaves the serial, not when it is queued
+        it->send_time = now_ + frame_handler_.OutputDelay();
+        ArmRetransmit(it);
+        in_flight++;
     }
     return true;
 }
@@ -334,18 +987,20 @@ int Frame::PrepareUFrame(UFrame type, uint8_t* frame_data) {
     return len;
 }
 
-int Frame::PrepareIFrame(uint8_t* data, int size, uint8_t* frame_data, bool more) {
-    if (data != NULL && size != 0) {
-        frame_data[0] = cImark;
-        // TODO(endian)
-        uint16_t mark_size = more ? (size | 0x8000) : (size & 0x7fff);
-        memcpy(frame_data + 1, &mark_size, sizeof(uint16_t));
-        memcpy(frame_data + 3, &mark_size, sizeof(uint16_t));
-        frame_data[5] = cImark;
-        memcpy(frame_data + cIDataOffset, data, size);
-        frame_data[size + cIFixedLength - 1] = 0x10;
-        return size + cIFixedLength;
+int Frame::PrepareIFrame(uint8_t* data, int size, uint8_t* frame_data, int flags) {
+    if (data == NULL || size == 0) {
+        return 0;
+    }
+    // flags other than more are carried by the extended i-frame, the wide one is extended too
+    bool more = (flags & IFRAME_MORE) != 0;
+    uint8_t extended = (uint8_t)(flags & ~(IFRAME_MORE | IFRAME_CRC32C));
+    int fields = (flags & IFRAME_ACK) ? cXAckLength : 0;
+    if (flags & IFRAME_CRC32C) {
+        return IFrameCodec<cWmark>::Encode(data, size, more, extended, fields, frame_data);
+    }
+    if (extended) {
+        return IFrameCodec<cXmark>::Encode(data, size, more, extended, fields, frame_data);
     }
-    return 0;
+    return IFrameCodec<cImark>::Encode(data, size, more, 0, 0, frame_data);
 }
 };  // namespace protocol
\ No newline at end of file
@@ -6,12 +6,61 @@
 #include <mutex>
 
 #include "layer.h"
+#include "memory.h"
+#include "rtt.h"
+#include "timer.h"
 
 namespace protocol {
 
 struct APCIParameters {
-    float time_alive;
+    float time_alive;    // upper bound of the retransmission timeout
     float time_heart;
+    float time_rto_min;  // lower bound of the retransmission timeout, 0 for default
+    int fec_parity;      // Reed-Solomon parity bytes per 255-byte codeword of i-frame, 1..fec::cMaxNsym, 0 to disable
+    int fragment_min;    // lower bound of user data per i-frame, 0 for default
+    int fragment_max;    // upper bound of user data per i-frame, 0 for default
+    int frame_size;      // largest i-frame accepted from peer, 0 for default
+    int window_size;     // unconfirmed i-frames allowed in flight, 0 for default
+    int compression;     // compress messages for peer supporting it, 0 to disable
+    const uint8_t* dictionary;  // shared dictionary for compression, NULL for none, has to be same on both sides
+    int dictionary_size;
+    int resumable;  // keep unconfirmed frames and sequence state over link reset for peer supporting it, 0 to disable
+    int crc_type;   // CrcType of i-frames, CRC_TYPE_32C is used if peer sets it too, 0 for CRC_TYPE_16
+    float time_ack_delay;  // delay of the ack while an i-frame to peer may carry it, used if peer sets it too, 0 to disable
+    MemoryResource* memory_resource;  // source of the queues and buffers of link, NULL for the heap, has to outlive the link
+    int message_max;  // largest message accepted from peer after decompression, 0 for default
+};
+
+enum Feature { FEATURE_FEC = 0x1,
+               FEATURE_COMPRESSION = 0x2,
+               FEATURE_CHANNELS = 0x4,
+               FEATURE_RESUME = 0x8,
+               FEATURE_ACK = 0x10 };
+
+enum CrcType { CRC_TYPE_16 = 0x1,
+               CRC_TYPE_32C = 0x2 };
+
+struct Capabilities {
+    uint16_t frame_size;     // largest i-frame accepted
+    uint8_t window_size;     // unconfirmed i-frames allowed in flight
+    uint8_t crc_types;       // bitmask of CrcType
+    uint8_t features;        // bitmask of Feature
+    uint8_t fec_parity;      // Reed-Solomon parity bytes requested for i-frame
+    uint16_t dictionary_id;  // checksum of the shared compression dictionary, 0 for none
+};
+
+struct LinkStats {
+    uint64_t frames_sent;        // i-frames sended, retransmissions included
+    uint64_t frames_retransmit;  // i-frames retransmitted on timeout or nak
+    uint64_t frames_confirmed;   // i-frames confirmed by peer
+    uint64_t frames_received;    // i-frames received with valid checksum
+    uint64_t frames_corrupted;   // frames dropped on size or checksum error, or uncorrectable by fec
+    uint64_t bytes_sent;         // bytes of i-frames sended, retransmissions included
+    double byte_error_rate;      // estimated probability that a sended byte is corrupted
+    uint64_t srtt;               // smoothed round-trip time in ms
+    uint64_t rto;                // current retransmission timeout in ms
+    int fragment_size;           // user data per i-frame currently chosen by master
+    uint64_t message_bytes;      // bytes of messages sended by master before compression
 };
 
 enum UFrame { START = 0x1,
@@ -23,8 +72,17 @@ enum UFrame { START = 0x1,
               TESTFR = 0x40,
               TESTFRC = 0x80 };
 
+enum IFrameFlag { IFRAME_MORE = 0x1,         // more fragments of the message follow
+                  IFRAME_COMPRESSED = 0x2,   // message is compressed
+                  IFRAME_DICTIONARY = 0x4,   // message is compressed with the shared dictionary
+                  IFRAME_CHANNEL = 0x8,      // the byte after the flags is the logical channel of message
+                  IFRAME_CRC32C = 0x10,      // checked by CRC-32C, told by the frame mark instead of flags
+                  IFRAME_ACK = 0x20 };       // the frame no expected from peer follows the flags, filled when sended
+
 typedef std::function<bool(UFrame)> UFrameHandler;
-typedef std::function<bool(uint8_t*, int, bool)> IFrameHandler;
+typedef std::function<bool(uint8_t*, int, int)> IFrameHandler;
+typedef std::function<void(uint32_t, bool)> ConfirmHandler;
+typedef std::function<void()> ResetHandler;
 
 class Frame {
    public:
@@ -44,6 +102,22 @@ class Frame {
         u_handler_ = serial_receiver;
     }
 
+    /// @brief Register a callback handler for the end of tagged frames
+    /// NOTE: The handler is called from Run without lock held, with the tag and whether the frame
+    /// was confirmed by peer or dropped on reset of the link.
+    /// @param confirm_handler user provided callback handler function
+    void SetConfirmHandler(ConfirmHandler confirm_handler) {
+        confirm_handler_ = confirm_handler;
+    }
+
+    /// @brief Register a callback handler for the loss of session
+    /// NOTE: The handler is called from Run without lock held after the frames in send queue are
+    /// dropped, on reset of the link unless the session is resumable or when the peer does not resume it.
+    /// @param reset_handler user provided callback handler function
+    void SetResetHandler(ResetHandler reset_handler) {
+        reset_handler_ = reset_handler;
+    }
+
     /// @brief Receive a new message and run the protocol state machine(s).
     /// NOTE: This function has to be called frequently in order to send and receive messages to and from sides.
     /// @return
@@ -54,6 +128,26 @@ class Frame {
     /// @param size the size of frame buffer
     void SendFrame(uint8_t* data, int size);
 
+    /// @brief Send a frame to sides and report its end to the confirm handler
+    /// @param data the frame buffer to be send
+    /// @param size the size of frame buffer
+    /// @param tag user provided tag passed to the confirm handler, 0 for no report
+    void SendFrame(uint8_t* data, int size, uint32_t tag);
+
+    /// @brief Get the number of frames in send queue
+    /// NOTE: sended frames are counted until they are confirmed
+    /// @return the number of frames
+    int QueuedFrames();
+
+    /// @brief Get the statistics of the link
+    /// @return a snapshot of the statistics
+    LinkStats GetStats();
+
+    /// @brief Get the settings of the link negotiated with peer during startdt
+    /// NOTE: the settings of the original protocol are used until the peer has send its capabilities
+    /// @return the negotiated settings
+    Capabilities GetCapabilities();
+
     /// @brief Generate user specified u-frame
     /// @param type u-frame type
     /// @param frame_data the buffer to store frame data
@@ -64,9 +158,9 @@ class Frame {
     /// @param data user data buffer
     /// @param size the size of user data
     /// @param frame_data the buffer to store frame data
-    /// @param more has more data
+    /// @param flags bitmask of IFrameFlag, flags other than more need a peer supporting the extended i-frame
     /// @return the size of frame
-    static int PrepareIFrame(uint8_t* data, int size, uint8_t* frame_data, bool more);
+    static int PrepareIFrame(uint8_t* data, int size, uint8_t* frame_data, int flags);
 
    private:
     /// @brief Callback handler function for layer
@@ -75,36 +169,170 @@ class Frame {
     /// @param size the size of msg
     static void MessageHandler(void* parameter, uint8_t* msg, int size);
 
+    /// @brief Run the protocol state machine(s) once
+    /// NOTE: all frames received by then are handled first, the timers and the send queue follow once
+    /// @return false if the link is reset, true otherwise
+    bool RunOnce();
+
+    /// @brief Handle a received frame
+    /// @param buffer the received frame, cleared if it is corrupted
+    /// @return false if the link is reset, true otherwise
+    bool HandleMessage(uint8_t* buffer);
+
+    /// @brief Report the end of a frame to the confirm handler
+    /// NOTE: queue mutex has to be locked, the report is delivered at the end of Run
+    /// @param it the frame in msg queue
+    /// @param confirmed whether the frame was confirmed by peer
+    void Complete(std::list<struct sMsg, Allocator<struct sMsg>>::iterator it, bool confirmed);
+
     /// @brief Reset the timeout of serial connection
+    /// NOTE: queue mutex has to be locked
     void ResetTimeout();
 
     /// @brief Handle the timeout event of serial connection
+    /// NOTE: runs the timers whose deadlines are reached
     /// @return false in case of timeout, false
     bool HandleTimeout();
 
-    /// @brief Send the first frame in msg queue
+    /// @brief Test the link after no frame has arrived for the heart time
+    /// @return false if the test frames are not confirmed or cannot be sended, true otherwise
+    bool HandleHeartbeat();
+
+    /// @brief Schedule the retransmission timeout of a sended frame
+    /// NOTE: queue mutex has to be locked
+    /// @param it the frame in msg queue
+    void ArmRetransmit(std::list<struct sMsg, Allocator<struct sMsg>>::iterator it);
+
+    /// @brief Send a frame and the following again if it is not confirmed in time
+    /// @param it the frame in msg queue
+    /// @return true
+    bool HandleRetransmit(std::list<struct sMsg, Allocator<struct sMsg>>::iterator it);
+
+    /// @brief Acknowledge the received i-frames, by an i-frame sended within the ack delay or else by an ack
+    /// NOTE: the ack is sended at once when half of the window is waiting for it
+    /// @return true in case of success, false otherwise
+    bool AckIFrame();
+
+    /// @brief Send the frames in msg queue as far as the window allows
     bool SendSingleMessage();
 
+    /// @brief Handle a received i-frame and acknowledge it
+    /// @param buffer the received frame
+    /// @return true in case of success, false otherwise
+    bool HandleIFrame(uint8_t* buffer);
+
+    /// @brief Send a negative acknowledgement naming the expected frame number
+    /// NOTE: only to peer knowing it
+    /// @return true in case of success, false otherwise
+    bool SendNak();
+
+    /// @brief Send a acknowledgement naming the expected frame number
+    /// @param mark cKmark for acknowledgement, cNmark for negative acknowledgement
+    /// @return true in case of success, false otherwise
+    bool SendAck(uint8_t mark);
+
+    /// @brief Confirm the frames before the expected frame number
+    /// @param expect_frame_no the frame number expected by the peer
+    void HandleAck(uint16_t expect_frame_no);
+
+    /// @brief Retransmit the frames from the expected frame number
+    /// @param expect_frame_no the frame number expected by the peer
+    void HandleNak(uint16_t expect_frame_no);
+
+    /// @brief Send the capabilities of this side
+    /// NOTE: queue mutex has to be locked
+    /// @param sync whether the peer has to take over the frame number
+    /// @return true in case of success, false otherwise
+    bool SendCapabilities(bool sync);
+
+    /// @brief Take over the capabilities of peer and answer them if needed
+    /// NOTE: queue mutex has to be locked
+    /// @param payload the decoded capabilities payload
+    /// @param size the size of payload
+    /// @return true in case of success, false otherwise
+    bool HandleCapabilities(uint8_t* payload, int size);
+
+    /// @brief Get the settings of the link from the capabilities of both sides
+    /// NOTE: queue mutex has to be locked
+    /// @return the negotiated settings
+    Capabilities Negotiate();
+
+    /// @brief Mark the frames in flight to be sended again
+    /// @param it the first frame to be sended again
+    /// @return the number of frames marked
+    int GoBack(std::list<struct sMsg, Allocator<struct sMsg>>::iterator it);
+
+    /// @brief Account a transmission of i-frame for the error rate estimation
+    /// @param size the size of frame
+    /// @param success whether the transmission was confirmed
+    void RecordAttempt(int size, bool success);
+
+    /// @brief Feed the round-trip time of a confirmed frame to the estimator
+    /// @param it the confirmed frame in msg queue
+    void ConfirmFrame(std::list<struct sMsg, Allocator<struct sMsg>>::iterator it);
+
+    /// @brief Check if the session is kept over a reset of the link
+    /// NOTE: queue mutex has to be locked
+    /// @return true if both sides support resumption, false otherwise
+    bool Resumable();
+
+    /// @brief Drop the frames in send queue and continue with a new frame number
+    /// NOTE: queue mutex has to be locked
+    void DropSession();
+
     void ResetAll();
 
    private:
     Layer frame_handler_;
     APCIParameters apci_parameters_;
+    RttEstimator rtt_estimator_;
+    TimerWheel timer_wheel_;  // deadlines of the link, run by the thread of Run
+    Timer heart_timer_;
+    Timer ack_timer_;  // delayed ack of received i-frames, cancelled by an i-frame carrying it
+    int ack_pending_;  // i-frames received since the last ack
+    uint64_t now_;  // monotonic time in ms, read once per run
+    uint8_t recv_buffer_[cMaxFrameLength];
 
    private:
-    uint64_t next_heart_timeout_;
     int no_confirm_msg_;
     int send_frame_no_;
     int recv_frame_no_;
+    bool recv_error_;
+    bool recv_synced_;
+    int nak_ignore_;  // naks still expected for the frames in flight when going back
+
+   private:
+    bool resuming_;             // session kept over reset, i-frames wait until the peer tells what it has received
+    uint64_t resume_time_;      // when the capabilities asking peer to resume were sended
+    bool reset_;                // session dropped and not yet reported
+    uint16_t session_id_;       // changes whenever the state of session is dropped
+    uint16_t peer_session_id_;  // session id of peer, 0 until known
+
+   private:
+    Capabilities local_caps_;
+    Capabilities peer_caps_;
+    bool peer_caps_valid_;   // peer has send its capabilities
+    bool peer_knows_caps_;   // peer has received our capabilities
+    bool caps_flag_sended_;  // peer_caps_valid_ in the last capabilities sended
+
+   private:
+    LinkStats stats_;
+    double attempt_count_;
+    double attempt_bytes_;
+    double success_count_;
 
    private:
     typedef struct sMsg Msg;
-    std::list<Msg> msg_queue_;
+    std::list<Msg, Allocator<Msg>> msg_queue_;
     std::mutex queue_mutex_;
+    std::vector<std::pair<uint32_t, bool>> completions_;  // ends of tagged frames not yet reported
+    std::vector<std::pair<uint32_t, bool>> reporting_;    // ends of tagged frames being reported by Run
 
    private:
     IFrameHandler i_handler_;
     UFrameHandler u_handler_;
+    ConfirmHandler confirm_handler_;
+    ResetHandler reset_handler_;
 };
 
 };  // namespace protocol
@@ -1,101 +1,167 @@
 #include "layer.h"
 
-#include <memory>
+#include <string.h>
 
-#include "endian.h"
+#include "codec.h"
+#include "fec/fec.h"
 
 namespace protocol {
 
-bool Layer::SendSingleMessage(uint8_t* msg, int size) {
+bool Layer::SendSingleMessage(const uint8_t* msg, int size) {
     if (!serial_connection_->is_open() &&
         !serial_connection_->Open()) {
         return false;
     }
 
-    std::unique_ptr<uint8_t[]> buffer(new uint8_t[size + 2]);
-    memcpy(buffer.get(), &cBmark, sizeof(cBmark));
-    memcpy(buffer.get() + 1, msg, size);
-    if (serial_connection_->Write(buffer.get(), size + 1) > 0) {
+    if (fec_parity_ > 0 && IsIFrameMark(msg[0])) {
+        // [cBmark][cFmark][size][parity][crc8][interleaved codewords]
+        int encoded = fec::rs_encoded_size(size, fec_parity_);
+        fec_buffer_.resize(1 + cFHeaderLength + encoded);
+        uint8_t* header = fec_buffer_.data() + 1;
+        fec_buffer_[0] = cBmark;
+        header[0] = cFmark;
+        StoreLe16(header + 1, (uint16_t)size);
+        header[3] = (uint8_t)fec_parity_;
+        Checksum<8>::Store(header + 1, 3, header + 4);
+        fec::rs_encode(msg, size, fec_parity_, header + cFHeaderLength);
+        return serial_connection_->Write(fec_buffer_.data(), (int)fec_buffer_.size()) == (int)fec_buffer_.size();
+    }
+
+    tx_buffer_.resize(1 + size);
+    tx_buffer_[0] = cBmark;
+    memcpy(tx_buffer_.data() + 1, msg, size);
+    if (serial_connection_->Write(tx_buffer_.data(), size + 1) == size + 1) {
         return true;
     }
 
     return false;
 }
 
-int Layer::ReadBytesWithTimeout(uint8_t* buffer, int count) {
-    int read;
-    int bytes = 0;
+int Layer::OutputDelay() {
+    int baud_rate = serial_connection_->baud_rate();
+    if (baud_rate <= 0) {
+        return 0;
+    }
+    int64_t bits = (int64_t)serial_connection_->OutputQueue() * serial_connection_->character_bits();
+    return (int)((bits * 1000 + baud_rate - 1) / baud_rate);
+}
 
-    while ((read = serial_connection_->ReadByte()) != -1) {
-        buffer[bytes++] = (uint8_t)read;
-        if (bytes >= count)
-            break;
+bool Layer::Receive(int timeout, int count) {
+    // the frame begun stays, the bytes before it are done
+    if (rx_begin_ > 0) {
+        memmove(rx_buffer_.data(), rx_buffer_.data() + rx_begin_, rx_end_ - rx_begin_);
+        rx_end_ -= rx_begin_;
+        rx_begin_ = 0;
+    }
+    if ((int)rx_buffer_.size() < count) {
+        rx_buffer_.resize(count);
     }
 
-    return bytes;
+    serial_connection_->SetTimeout(timeout);
+    int read = serial_connection_->Read(rx_buffer_.data() + rx_end_, (int)rx_buffer_.size() - rx_end_);
+    if (read <= 0) {
+        return false;
+    }
+    rx_end_ += read;
+    return true;
 }
 
-bool Layer::ReadNextMessage(uint8_t* buffer, SerialMessageHandler message_handler, void* parameter) {
+int Layer::FrameLength(const uint8_t* data, int available) {
+    // data begins with cBmark, a length beyond available tells how many bytes are needed
+    if (available < 2) {
+        return 2;
+    }
+    uint8_t mark = data[1];
+    if (IsIFrameMark(mark)) {
+        if (available < 4) {
+            return 4;
+        }
+        int length = (LoadLe16(data + 2) & 0x7fff) + IFrameFixedLength(mark);
+        return length > cMaxFrameLength ? -1 : 1 + length;
+    } else if (mark == cUmark) {
+        return 1 + cUFixedLength;
+    } else if (mark == cNmark || mark == cKmark) {
+        return 1 + cNFixedLength;
+    } else if (mark == cAmark) {
+        return 1 + (int)sizeof(cAmark);
+    } else if (mark == cCmark) {
+        if (available < 3) {
+            return 3;
+        }
+        return data[2] > cCMaxLength ? -1 : 1 + data[2] + 3;
+    } else if (mark == cFmark) {
+        if (available < 1 + cFHeaderLength) {
+            return 1 + cFHeaderLength;
+        }
+        const uint8_t* header = data + 1;
+        int msg_size = LoadLe16(header + 1);
+        int parity = header[3];
+        if (!Checksum<8>::Check(header + 1, 3, header + 4) || msg_size < cIFixedLength || msg_size > cMaxFrameLength ||
+            parity < 1 || parity > fec::cMaxNsym) {
+            return -1;
+        }
+        return 1 + cFHeaderLength + fec::rs_encoded_size(msg_size, parity);
+    }
+    return -1;
+}
+
+bool Layer::ReadNextMessage(uint8_t* buffer, SerialMessageHandler message_handler, void* parameter, bool wait) {
     if (!serial_connection_->is_open() &&
         !serial_connection_->Open()) {
         return false;
     }
 
-    serial_connection_->SetTimeout(message_timeout_);
-    do {
-        int read = serial_connection_->ReadByte();
-        if (read < 0)
+    while (true) {
+        while (rx_begin_ < rx_end_ && rx_buffer_[rx_begin_] != cBmark) {
+            rx_begin_++;
+        }
+        if (rx_begin_ == rx_end_) {
+            rx_begin_ = rx_end_ = 0;
+            if (wait && Receive(message_timeout_, 0)) {
+                continue;
+            }
             break;
+        }
 
-        if (read != cBmark)
+        int available = rx_end_ - rx_begin_;
+        int length = FrameLength(rx_buffer_.data() + rx_begin_, available);
+        if (length < 0) {
+            // no frame, look for the next mark
+            rx_begin_++;
             continue;
-
-        read = serial_connection_->ReadByte();
-        if (read < 0)
-            break;
-
-        if (read == cImark) {
-            serial_connection_->SetTimeout(character_timeout_);
-
-            int l_size = serial_connection_->ReadByte();
-            int h_size = serial_connection_->ReadByte();
-            if (l_size == -1 || h_size == -1) {
-                continue;
+        }
+        if (length > available) {
+            // the rest of frame follows within the character timeout
+            if (!wait) {
+                break;
             }
-
-            int msg_size = (cint16(l_size, h_size)) & 0x7fff;
-            buffer[0] = cImark;
-            buffer[1] = l_size;
-            buffer[2] = h_size;
-            msg_size += 3 + cIFixedLength - cIHeaderLength;
-
-            int bytes = ReadBytesWithTimeout(buffer + 3, msg_size);
-            if (bytes == msg_size) {
-                msg_size += 3;
-                message_handler(parameter, buffer, msg_size);
-                return true;
+            if (!Receive(character_timeout_, length)) {
+                // the mark of a frame not read completely is no frame
+                rx_begin_++;
+                break;
             }
+            continue;
+        }
 
-        } else if (read == cUmark) {
-            serial_connection_->SetTimeout(character_timeout_);
-
-            buffer[0] = cUmark;
-            int msg_size = cUFixedLength - sizeof(cUmark);
-            int bytes = ReadBytesWithTimeout(buffer + sizeof(cUmark), msg_size);
-            if (bytes == msg_size) {
-                msg_size += sizeof(cUmark);
-                message_handler(parameter, buffer, msg_size);
-                return true;
+        const uint8_t* frame = rx_buffer_.data() + rx_begin_ + 1;
+        int msg_size = length - 1;
+        rx_begin_ += length;
+        if (frame[0] == cFmark) {
+            // an uncorrectable frame is dropped, the peer sends it again on the nak of the next one or its timeout
+            msg_size = LoadLe16(frame + 1);
+            if (fec::rs_decode(frame + cFHeaderLength, msg_size, frame[3], buffer) < 0) {
+                decode_errors_++;
+                continue;
             }
-
-        } else if (read == cAmark) {
-            buffer[0] = cAmark;
-            message_handler(parameter, buffer, (int)sizeof(cAmark));
-            return true;
+        } else {
+            memcpy(buffer, frame, msg_size);
         }
-    } while (true);
+        message_handler(parameter, buffer, msg_size);
+        return true;
+    }
 
+    buffer[0] = 0;
     return false;
 }
 
-}  // namespace protocol
\ No newline at end of file
+}  // namespace protocol
@@ -1,7 +1,9 @@
 #ifndef _LAYER_H
 #define _LAYER_H
 
+#include <atomic>
 #include <functional>
+#include <vector>
 
 #include "raw/serial_base.h"
 
@@ -15,40 +17,98 @@ const uint8_t cBmark = 0xAA;
 const uint8_t cImark = 0x96;
 const uint8_t cUmark = 0x38;
 const uint8_t cAmark = 0xe5;
+const uint8_t cNmark = 0x5a;
+const uint8_t cFmark = 0x6c;
+const uint8_t cKmark = 0x4b;
+const uint8_t cCmark = 0xc3;
+const uint8_t cXmark = 0xa5;
+const uint8_t cWmark = 0x69;
 const uint8_t cEmark = 0x10;
 
 const uint8_t cIHeaderLength = 0x6;
 const uint8_t cIDataOffset = 0x8;
 const uint8_t cIFixedLength = 0xB;
+const uint8_t cXFlagsLength = 0x1;
+const uint8_t cXAckLength = 0x2;
+const uint8_t cWChecksumExtra = 0x2;
+const uint8_t cXChannelLength = 0x1;
 const uint8_t cUFixedLength = 0x4;
+const uint8_t cNFixedLength = 0x5;
+const uint8_t cKFixedLength = 0x5;
+const uint8_t cFHeaderLength = 0x5;
+const uint8_t cCMaxLength = 0x40;
+const uint16_t cMaxDataLength = 0x7fff;
+const uint16_t cMaxFrameLength = cMaxDataLength + cIFixedLength;
+const int cRxBufferSize = 0x10000;
+
+/// @brief Check if a frame carries user data
+/// NOTE: the extended i-frame (cXmark) has the layout of i-frame, the first data byte holds its flags.
+/// The wide i-frame (cWmark) is an extended one with a CRC-32C instead of the CRC-16.
+inline bool IsIFrameMark(uint8_t mark) { return mark == cImark || mark == cXmark || mark == cWmark; }
+
+/// @brief Get the bytes of an i-frame besides its data
+inline int IFrameFixedLength(uint8_t mark) { return mark == cWmark ? cIFixedLength + cWChecksumExtra : cIFixedLength; }
 
 class Layer {
    public:
     Layer(SerialPortBase* serial_connection) : serial_connection_(serial_connection) {
         message_timeout_ = 10;
         character_timeout_ = 300;
+        fec_parity_ = 0;
+        decode_errors_ = 0;
+        tx_buffer_.reserve(1 + cMaxFrameLength);
+        rx_buffer_.resize(cRxBufferSize);
+        rx_begin_ = 0;
+        rx_end_ = 0;
     }
     ~Layer() { ; }
 
+    /// @brief Enable forward error correction for the sended i-frame
+    /// NOTE: received fec frames are always decoded, whatever the setting is
+    /// @param parity number of Reed-Solomon parity bytes per codeword, 0 to disable
+    void SetFec(int parity) { fec_parity_ = parity; }
+
+    /// @brief Get the number of received fec frames dropped as uncorrectable
+    uint64_t decode_errors() { return decode_errors_; }
+
+    /// @brief Set the time to wait for the begin of a frame
+    /// @param timeout the time in ms
+    void SetMessageTimeout(int timeout) { message_timeout_ = timeout; }
+
     /// @brief Send a message of single frame
     /// @param msg data pointer to the frame.
     /// @param size data size of the frame
     /// @return true in case of success, false otherwise
-    bool SendSingleMessage(uint8_t* msg, int size);
+    bool SendSingleMessage(const uint8_t* msg, int size);
+
+    /// @brief Get the time until the bytes written are sended by the serial at line rate
+    /// NOTE: 0 if the serial does not tell the bytes in its output queue
+    /// @return the time in ms
+    int OutputDelay();
 
     /// @brief Read single frame from serial by registered callback
-    /// @param buffer buffer to store the received data
+    /// NOTE: The bytes ready are read at once into the receive buffer and the frames are taken from there,
+    /// so that a burst of frames costs one read. Without wait only the frames complete in the buffer are
+    /// taken, the bytes of a frame begun stay for the next read.
+    /// @param buffer buffer to store the received data, cMaxFrameLength bytes
     /// @param message_handler provided callback handler function
     /// @param parameter provided parameter that is passed to the callback handler
+    /// @param wait whether to wait for a frame on serial, with the message timeout
     /// @return true in case of success, false otherwise
-    bool ReadNextMessage(uint8_t* buffer, SerialMessageHandler message_handler, void* parameter);
+    bool ReadNextMessage(uint8_t* buffer, SerialMessageHandler message_handler, void* parameter, bool wait = true);
 
    private:
-    /// @brief Read data from serial until count
-    /// @param buffer buffer to store the received data
-    /// @param count number of bytes to received
-    /// @return number of received bytes
-    int ReadBytesWithTimeout(uint8_t* buffer, int count);
+    /// @brief Read the bytes ready into the receive buffer
+    /// @param timeout the time to wait for a byte in ms
+    /// @param count the bytes of the frame begun the buffer has to hold
+    /// @return true if any byte was read, false otherwise
+    bool Receive(int timeout, int count);
+
+    /// @brief Get the length of the frame at the begin of data
+    /// @param data data pointer to the frame, beginning with cBmark
+    /// @param available the bytes of frame received
+    /// @return length of frame with cBmark, more than available if the header is not complete yet, -1 if no frame
+    static int FrameLength(const uint8_t* data, int available);
 
    private:
     SerialPortBase* serial_connection_;
@@ -56,6 +116,17 @@ class Layer {
    private:
     int message_timeout_;
     int character_timeout_;
+
+   private:
+    int fec_parity_;
+    std::atomic<uint64_t> decode_errors_;  // fec frames dropped as uncorrectable
+    std::vector<uint8_t> fec_buffer_;
+    std::vector<uint8_t> tx_buffer_;  // frame led by cBmark, kept over the frames sended
+
+   private:
+    std::vector<uint8_t> rx_buffer_;
+    int rx_begin_;  // bytes from begin to end are received and not yet taken
+    int rx_end_;
 };
 
 };  // namespace protocol
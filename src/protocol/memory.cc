@@ -0,0 +1,101 @@
+#include "memory.h"
+
+#include <string.h>
+
+#include <new>
+
+namespace protocol {
+
+namespace {
+
+class NewDeleteResource : public MemoryResource {
+   public:
+    void* Allocate(size_t size) { return ::operator new(size); }
+    void Deallocate(void* block, size_t) { ::operator delete(block); }
+};
+
+}  // namespace
+
+MemoryResource* HeapResource() {
+    static NewDeleteResource resource;
+    return &resource;
+}
+
+ArenaResource::ArenaResource(void* buffer, size_t size, MemoryResource* upstream)
+    : upstream_(upstream) {
+    // blocks are aligned as operator new aligns them
+    uintptr_t align = alignof(max_align_t);
+    uintptr_t begin = ((uintptr_t)buffer + align - 1) & ~(align - 1);
+    uintptr_t end = (uintptr_t)buffer + size;
+    if (begin > end) {
+        begin = end;
+    }
+    begin_ = next_ = (uint8_t*)begin;
+    end_ = (uint8_t*)end;
+    memset(free_, 0, sizeof(free_));
+    memset(&stats_, 0, sizeof(stats_));
+    stats_.capacity = end - begin;
+}
+
+int ArenaResource::SizeClass(size_t size) {
+    int size_class = 0;
+    // stops at the largest block a size_t holds, larger sizes fail
+    while (((size_t)cMinBlock << size_class) < size && ((size_t)cMinBlock << size_class) <= ((size_t)-1 >> 1)) {
+        size_class++;
+    }
+    return size_class;
+}
+
+void* ArenaResource::Allocate(size_t size) {
+    int size_class = SizeClass(size);
+    size_t block = (size_t)cMinBlock << size_class;
+    if (block < size) {
+        throw std::bad_alloc();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        void* found = NULL;
+        if (free_[size_class]) {
+            found = free_[size_class];
+            free_[size_class] = free_[size_class]->next;
+        } else if ((size_t)(end_ - next_) >= block) {
+            found = next_;
+            next_ += block;
+            stats_.used += block;
+        }
+        if (found) {
+            stats_.in_use += block;
+            if (stats_.in_use > stats_.peak) {
+                stats_.peak = stats_.in_use;
+            }
+            return found;
+        }
+        stats_.overflows++;
+    }
+
+    if (upstream_ == NULL) {
+        throw std::bad_alloc();
+    }
+    return upstream_->Allocate(size);
+}
+
+void ArenaResource::Deallocate(void* block, size_t size) {
+    if (block < (void*)begin_ || block >= (void*)end_) {
+        upstream_->Deallocate(block, size);
+        return;
+    }
+
+    int size_class = SizeClass(size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    FreeBlock* free_block = (FreeBlock*)block;
+    free_block->next = free_[size_class];
+    free_[size_class] = free_block;
+    stats_.in_use -= (size_t)cMinBlock << size_class;
+}
+
+ArenaStats ArenaResource::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+}  // namespace protocol
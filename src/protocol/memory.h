@@ -0,0 +1,113 @@
+#ifndef _MEMORY_H
+#define _MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+namespace protocol {
+
+/// @brief Source of the memory of link buffers and queues
+/// NOTE: Allocate throws std::bad_alloc when it has no memory left, as operator new does.
+class MemoryResource {
+   public:
+    virtual ~MemoryResource() { ; }
+
+    /// @brief Allocate a block aligned for any type
+    /// @param size the size of block
+    /// @return the block
+    virtual void* Allocate(size_t size) = 0;
+
+    /// @brief Give back a block
+    /// @param block the block returned by Allocate
+    /// @param size the size passed to Allocate
+    virtual void Deallocate(void* block, size_t size) = 0;
+};
+
+/// @brief Get the resource of operator new and delete, used where no resource is set
+MemoryResource* HeapResource();
+
+struct ArenaStats {
+    size_t capacity;   // size of the buffer of arena
+    size_t used;       // bytes of buffer handed out as blocks, in use or free for reuse
+    size_t in_use;     // bytes of blocks allocated and not given back
+    size_t peak;       // highest in_use
+    uint64_t overflows;  // blocks allocated from upstream as the buffer was used up
+};
+
+/// @brief Resource taking blocks from a fixed buffer supplied by user
+/// NOTE: The blocks are rounded up to a power of two, at least cMinBlock bytes, and a block given back is
+/// kept on the free list of its size for the next allocation of that size. The queues and buffers of link
+/// take the same sizes over and over, so once they have grown the link allocates nothing new. The buffer
+/// is cut from the front and never compacted, it has to hold the peak of each size at once. When it is used
+/// up the blocks come from upstream if given, else std::bad_alloc is thrown. The resource is thread safe.
+class ArenaResource : public MemoryResource {
+   public:
+    static const size_t cMinBlock = 16;
+
+    /// @param buffer the buffer to cut the blocks from, it has to outlive the resource and its blocks
+    /// @param size the size of buffer
+    /// @param upstream the resource allocated from when the buffer is used up, NULL to fail
+    ArenaResource(void* buffer, size_t size, MemoryResource* upstream = NULL);
+    ~ArenaResource() { ; }
+
+    void* Allocate(size_t size);
+    void Deallocate(void* block, size_t size);
+
+    /// @brief Get the statistics of arena
+    /// @return a snapshot of the statistics
+    ArenaStats GetStats();
+
+   private:
+    /// @brief Get the size class of a block, the log2 of its rounded size
+    static int SizeClass(size_t size);
+
+   private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    std::mutex mutex_;
+    uint8_t* begin_;
+    uint8_t* end_;
+    uint8_t* next_;  // first byte of buffer not yet handed out
+    MemoryResource* upstream_;
+    FreeBlock* free_[sizeof(size_t) * 8];  // blocks given back by size class
+    ArenaStats stats_;
+};
+
+/// @brief Allocator of standard containers taking its memory from a resource
+/// NOTE: The containers sharing a resource may swap and splice their contents.
+template <class T>
+class Allocator {
+   public:
+    typedef T value_type;
+
+    Allocator() : resource_(HeapResource()) {}
+    /// @param resource the resource of memory, NULL for the heap
+    Allocator(MemoryResource* resource) : resource_(resource ? resource : HeapResource()) {}
+    template <class U>
+    Allocator(const Allocator<U>& other) : resource_(other.resource()) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(resource_->Allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { resource_->Deallocate(p, n * sizeof(T)); }
+
+    MemoryResource* resource() const { return resource_; }
+
+   private:
+    MemoryResource* resource_;
+};
+
+template <class T, class U>
+bool operator==(const Allocator<T>& a, const Allocator<U>& b) { return a.resource() == b.resource(); }
+
+template <class T, class U>
+bool operator!=(const Allocator<T>& a, const Allocator<U>& b) { return a.resource() != b.resource(); }
+
+typedef std::vector<uint8_t, Allocator<uint8_t>> Buffer;
+
+}  // namespace protocol
+
+#endif
@@ -0,0 +1,58 @@
+#include "rtt.h"
+
+namespace protocol {
+
+RttEstimator::RttEstimator(uint64_t min_rto, uint64_t max_rto)
+    : min_rto_(min_rto), max_rto_(max_rto < min_rto ? min_rto : max_rto) {
+    Reset();
+}
+
+void RttEstimator::Reset() {
+    srtt_ = 0;
+    rttvar_ = 0;
+    has_sample_ = false;
+    rto_ = max_rto_;
+}
+
+void RttEstimator::Sample(uint64_t rtt) {
+    if (!has_sample_) {
+        // SRTT = R, RTTVAR = R/2
+        srtt_ = rtt << 3;
+        rttvar_ = rtt << 1;
+        has_sample_ = true;
+    } else {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+        uint64_t srtt = srtt_ >> 3;
+        uint64_t delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+        rttvar_ = rttvar_ - (rttvar_ >> 2) + delta;
+        srtt_ = srtt_ - (srtt_ >> 3) + rtt;
+    }
+
+    Restore();
+}
+
+void RttEstimator::Backoff() {
+    rto_ = Bound(rto_ << 1);
+}
+
+void RttEstimator::Restore() {
+    if (!has_sample_) {
+        rto_ = max_rto_;
+        return;
+    }
+
+    // RTO = SRTT + 4 * RTTVAR, at least one clock tick above SRTT
+    uint64_t var = rttvar_ ? rttvar_ : 1;
+    rto_ = Bound((srtt_ >> 3) + var);
+}
+
+uint64_t RttEstimator::Bound(uint64_t rto) const {
+    if (rto < min_rto_) {
+        return min_rto_;
+    } else if (rto > max_rto_) {
+        return max_rto_;
+    }
+    return rto;
+}
+
+};  // namespace protocol
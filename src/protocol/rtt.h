@@ -0,0 +1,53 @@
+#ifndef _RTT_H
+#define _RTT_H
+
+#include <stdint.h>
+
+namespace protocol {
+
+/// @brief Retransmission timeout estimator (Jacobson/Karn, RFC 6298)
+class RttEstimator {
+   public:
+    /// @brief Create a estimator bounded by [min_rto, max_rto]
+    /// @param min_rto the lower bound of timeout in ms
+    /// @param max_rto the upper bound of timeout in ms, also used until the first sample
+    RttEstimator(uint64_t min_rto, uint64_t max_rto);
+    ~RttEstimator() { ; }
+
+    /// @brief Drop all samples and restart from the upper bound
+    void Reset();
+
+    /// @brief Feed the round-trip time of a frame confirmed without retransmission
+    /// NOTE: Karn's rule, samples of retransmitted frames are ambiguous and must not be fed
+    /// @param rtt the measured round-trip time in ms
+    void Sample(uint64_t rtt);
+
+    /// @brief Double the timeout after a retransmission timer expired
+    void Backoff();
+
+    /// @brief Undo the backoff and go on from the samples
+    void Restore();
+
+    /// @brief Get the current retransmission timeout
+    /// @return the timeout in ms
+    uint64_t rto() const { return rto_; }
+
+    /// @brief Get the smoothed round-trip time
+    /// @return the smoothed round-trip time in ms, 0 if no sample yet
+    uint64_t srtt() const { return srtt_ >> 3; }
+
+   private:
+    /// @brief Clamp the timeout into [min_rto, max_rto]
+    uint64_t Bound(uint64_t rto) const;
+
+   private:
+    uint64_t min_rto_;
+    uint64_t max_rto_;
+    uint64_t rto_;
+    uint64_t srtt_;    // scaled by 8
+    uint64_t rttvar_;  // scaled by 4
+    bool has_sample_;
+};
+
+};  // namespace protocol
+#endif
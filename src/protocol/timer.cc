@@ -0,0 +1,187 @@
+#include "timer.h"
+
+#include <string.h>
+#ifdef __linux__
+#include <time.h>
+#else
+#include <Windows.h>
+#endif
+
+namespace protocol {
+
+uint64_t MonotonicTimeInMs() {
+#ifdef __linux__
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000LL) + (now.tv_nsec / 1000000);
+#else
+    return GetTickCount64();
+#endif
+}
+
+static int LowestBit(uint64_t bits) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+Timer& Timer::operator=(const Timer& other) {
+    if (this != &other) {
+        if (wheel_) {
+            wheel_->Cancel(this);
+        }
+        handler_ = other.handler_;
+    }
+    return *this;
+}
+
+Timer::~Timer() {
+    if (wheel_) {
+        wheel_->Cancel(this);
+    }
+}
+
+TimerWheel::TimerWheel(uint64_t now) : now_(now), overflow_(NULL) {
+    memset(slots_, 0, sizeof(slots_));
+    memset(occupied_, 0, sizeof(occupied_));
+}
+
+TimerWheel::~TimerWheel() {
+    for (int level = 0; level < LEVELS; level++) {
+        for (int slot = 0; slot < SLOTS; slot++) {
+            while (slots_[level][slot]) {
+                Unlink(slots_[level][slot]);
+            }
+        }
+    }
+    while (overflow_) {
+        Unlink(overflow_);
+    }
+}
+
+void TimerWheel::Schedule(Timer* timer, uint64_t deadline) {
+    if (timer->wheel_) {
+        timer->wheel_->Cancel(timer);
+    }
+    timer->deadline_ = deadline;
+    timer->wheel_ = this;
+    Insert(timer);
+}
+
+void TimerWheel::Cancel(Timer* timer) {
+    if (timer->wheel_ == this) {
+        Unlink(timer);
+    }
+}
+
+void TimerWheel::Insert(Timer* timer) {
+    // the lowest level whose turn holds the deadline, a passed deadline goes to the current slot
+    uint64_t deadline = timer->deadline_ > now_ ? timer->deadline_ : now_;
+    int level = 0;
+    while (level < LEVELS && (deadline >> (SLOT_BITS * (level + 1))) != (now_ >> (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    Timer** head = &overflow_;
+    timer->level_ = level;
+    timer->slot_ = 0;
+    if (level < LEVELS) {
+        timer->slot_ = (int)((deadline >> (SLOT_BITS * level)) & (SLOTS - 1));
+        head = &slots_[level][timer->slot_];
+        occupied_[level] |= 1ULL << timer->slot_;
+    }
+    timer->prev_ = NULL;
+    timer->next_ = *head;
+    if (*head) {
+        (*head)->prev_ = timer;
+    }
+    *head = timer;
+}
+
+void TimerWheel::Unlink(Timer* timer) {
+    Timer** head = timer->level_ < LEVELS ? &slots_[timer->level_][timer->slot_] : &overflow_;
+    if (timer->prev_) {
+        timer->prev_->next_ = timer->next_;
+    } else {
+        *head = timer->next_;
+    }
+    if (timer->next_) {
+        timer->next_->prev_ = timer->prev_;
+    }
+    if (*head == NULL && timer->level_ < LEVELS) {
+        occupied_[timer->level_] &= ~(1ULL << timer->slot_);
+    }
+    timer->prev_ = NULL;
+    timer->next_ = NULL;
+    timer->wheel_ = NULL;
+}
+
+void TimerWheel::Cascade() {
+    // the time has reached the slots of higher levels starting now, their timers move down
+    for (int level = LEVELS; level > 0; level--) {
+        if (now_ & ((1ULL << (SLOT_BITS * level)) - 1)) {
+            continue;
+        }
+        Timer*& head = level < LEVELS ? slots_[level][(now_ >> (SLOT_BITS * level)) & (SLOTS - 1)] : overflow_;
+        while (head) {
+            Timer* timer = head;
+            Unlink(timer);
+            timer->wheel_ = this;
+            Insert(timer);
+        }
+    }
+}
+
+uint64_t TimerWheel::NextDeadline() {
+    uint64_t pending = occupied_[0] & (~0ULL << (now_ & (SLOTS - 1)));
+    if (pending) {
+        return (now_ & ~(uint64_t)(SLOTS - 1)) + LowestBit(pending);
+    }
+    for (int level = 1; level < LEVELS; level++) {
+        int shift = SLOT_BITS * level;
+        int current = (int)((now_ >> shift) & (SLOTS - 1));
+        pending = current + 1 < SLOTS ? occupied_[level] & (~0ULL << (current + 1)) : 0;
+        if (pending) {
+            return ((now_ >> (shift + SLOT_BITS)) << (shift + SLOT_BITS)) + ((uint64_t)LowestBit(pending) << shift);
+        }
+    }
+    if (overflow_) {
+        int shift = SLOT_BITS * LEVELS;
+        return ((now_ >> shift) + 1) << shift;
+    }
+    return UINT64_MAX;
+}
+
+bool TimerWheel::Expire(uint64_t now) {
+    while (true) {
+        Timer*& head = slots_[0][now_ & (SLOTS - 1)];
+        while (head) {
+            Timer* timer = head;
+            Unlink(timer);
+            if (timer->handler_ && !timer->handler_()) {
+                return false;
+            }
+        }
+        if (now_ >= now) {
+            return true;
+        }
+
+        // skip the ticks without timers
+        uint64_t next = NextDeadline();
+        if (next > now) {
+            now_ = now;
+            return true;
+        }
+        now_ = next;
+        Cascade();
+    }
+}
+
+}  // namespace protocol
@@ -0,0 +1,97 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+namespace protocol {
+
+/// @brief Get the time of a clock that is never set, in ms
+/// NOTE: CLOCK_MONOTONIC, the time of day may step by NTP while the deadlines of links must not
+uint64_t MonotonicTimeInMs();
+
+typedef std::function<bool()> TimerHandler;
+
+class TimerWheel;
+
+/// @brief A deadline scheduled on a timer wheel
+/// NOTE: The timer leaves its wheel when it is destroyed, a copy is not scheduled.
+class Timer {
+   public:
+    Timer() : wheel_(NULL), prev_(NULL), next_(NULL), deadline_(0), level_(0), slot_(0) {}
+    Timer(const Timer& other) : Timer() { handler_ = other.handler_; }
+    Timer& operator=(const Timer& other);
+    ~Timer();
+
+    /// @brief Set the function called when the deadline is reached
+    /// NOTE: returning false stops the expiry of the wheel, it is reported by TimerWheel::Expire
+    void SetHandler(TimerHandler handler) { handler_ = handler; }
+
+    bool is_scheduled() { return wheel_ != NULL; }
+
+    uint64_t deadline() { return deadline_; }
+
+   private:
+    friend class TimerWheel;
+
+    TimerHandler handler_;
+    TimerWheel* wheel_;
+    Timer* prev_;
+    Timer* next_;
+    uint64_t deadline_;
+    int level_;
+    int slot_;
+};
+
+/// @brief Hierarchical timer wheel of 1 ms ticks
+/// NOTE: 4 levels of 64 slots cover 4.6 hours, later deadlines wait in a list until the top level turns.
+/// Scheduling and cancelling are O(1), the timers of a higher level are moved down once the time reaches
+/// their slot, so that each timer is moved at most once per level. The wheel is not locked, it belongs to
+/// the thread running the timers.
+class TimerWheel {
+   public:
+    /// @param now the current time in ms
+    TimerWheel(uint64_t now);
+    ~TimerWheel();
+
+    /// @brief Schedule or move a timer
+    /// NOTE: a deadline already passed expires with the next call of Expire
+    /// @param timer the timer
+    /// @param deadline the time in ms
+    void Schedule(Timer* timer, uint64_t deadline);
+
+    /// @brief Remove a timer from the wheel, nothing happens if it is not scheduled
+    void Cancel(Timer* timer);
+
+    /// @brief Advance the wheel and call the handlers of timers whose deadlines are reached
+    /// NOTE: the handlers may schedule and cancel any timer
+    /// @param now the current time in ms
+    /// @return false if a handler failed, the timers due after it expire with the next call
+    bool Expire(uint64_t now);
+
+    /// @brief Get the time the wheel has to be advanced next
+    /// NOTE: the deadline of the next timer, or earlier when the timers of a higher level are moved down
+    /// @return the time in ms, UINT64_MAX if no timer is scheduled
+    uint64_t NextDeadline();
+
+   private:
+    void Insert(Timer* timer);
+    void Unlink(Timer* timer);
+    void Cascade();
+
+   private:
+    enum { LEVELS = 4,
+           SLOT_BITS = 6,
+           SLOTS = 1 << SLOT_BITS };
+
+    uint64_t now_;
+    Timer* slots_[LEVELS][SLOTS];
+    uint64_t occupied_[LEVELS];  // bitmap of slots having timers
+    Timer* overflow_;            // timers beyond the top level
+};
+
+}  // namespace protocol
+
+#endif
@@ -52,12 +52,39 @@ class SerialPortBase {
     /// @return value of read byte, or -1 in case of an error
     virtual int ReadByte() = 0;
 
+    /// @brief Read the bytes available from the interface, up to the number of bytes
+    /// NOTE: Waits for the first byte as ReadByte does, the bytes following are taken if ready.
+    /// @param buffer the buffer to store the data read
+    /// @param length size of the buffer
+    /// @return number of bytes read, or -1 in case of an error or timeout
+    virtual int Read(uint8_t* buffer, int length) {
+        int read = ReadByte();
+        if (read < 0 || length <= 0) {
+            return -1;
+        }
+        buffer[0] = (uint8_t)read;
+        return 1;
+    }
+
     /// @brief Write the number of bytes from the buffer to the serial interface
     /// @param buffer the buffer containing the data to write
     /// @param length number of bytes to write
     /// @return number of bytes written, or -1 in case of an error
     virtual int Write(uint8_t* buffer, int length) = 0;
 
+    /// @brief Get the number of bytes written and not yet sended by the interface
+    /// @return number of bytes in the output queue, 0 if the interface does not tell
+    virtual int OutputQueue() { return 0; }
+
+    /// @brief Let the driver switch a RS-485 transceiver to send by RTS while it writes
+    /// NOTE: The setting is applied at once if the interface is open, else when it is opened and the
+    /// open fails if it cannot be applied.
+    /// @param enable whether RS-485 mode is enabled
+    /// @param delay_before delay between setting RTS and the first byte in ms
+    /// @param delay_after delay between the last byte and clearing RTS in ms
+    /// @return true in case of success, false if the interface does not support it
+    virtual bool SetRs485(bool enable, int /* delay_before */, int /* delay_after */) { return !enable; }
+
     /// @brief Set the timeout used for message reception
     /// @param timeout the timeout value in ms.
     virtual void SetTimeout(int timeout) = 0;
@@ -70,6 +97,14 @@ class SerialPortBase {
     /// @return
     bool is_open() { return is_open_; }
 
+    /// @brief Get the baud rate of the serial interface
+    /// @return
+    int baud_rate() { return baud_rate_; }
+
+    /// @brief Get the number of bits on line per byte, start, parity and stop bits included
+    /// @return
+    int character_bits() { return 1 + data_bits_ + (parity_ == 'N' ? 0 : 1) + stop_bits_; }
+
    protected:
     std::string interface_name_;
     int baud_rate_;
@@ -1,7 +1,12 @@
 #include "serial_linux.h"
 #ifdef __linux__
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/select.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -126,6 +131,14 @@ bool SerialPortLinux::Open() {
         return false;
     }
 
+    if (rs485_ && !ApplyRs485()) {
+        close(serial_fd_);
+        serial_fd_ = -1;
+        last_error_ = SERIAL_PORT_ERROR_INVALID_ARGUMENT;
+
+        return false;
+    }
+
     return is_open_ = true;
 }
 
@@ -142,16 +155,36 @@ void SerialPortLinux::Discard() {
 }
 
 int SerialPortLinux::ReadByte() {
+    uint8_t buf[1];
+    if (Read(buf, 1) == 1) {
+        return (int)buf[0];
+    }
+    return -1;
+}
+
+int SerialPortLinux::Read(uint8_t* buffer, int length) {
     last_error_ = SERIAL_PORT_ERROR_NONE;
     if (!is_open_) {
         last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
         return -1;
     }
 
+    // the port is non-blocking, the bytes ready are taken without waiting for them
+    ssize_t result = read(serial_fd_, buffer, length);
+    if (result > 0) {
+        return (int)result;
+    }
+    if (result < 0 && errno != EAGAIN && errno != EINTR) {
+        last_error_ = errno == EIO ? SERIAL_PORT_ERROR_IO_FAILED : SERIAL_PORT_ERROR_UNKNOWN;
+        return -1;
+    }
+
     fd_set set;
     FD_ZERO(&set);
     FD_SET(serial_fd_, &set);
-    int ret = select(serial_fd_ + 1, &set, NULL, NULL, &read_timeout_);
+    // select updates the timeout with the time left, the timeout is for every byte
+    struct timeval timeout = read_timeout_;
+    int ret = select(serial_fd_ + 1, &set, NULL, NULL, &timeout);
     if (ret == -1) {
         last_error_ = SERIAL_PORT_ERROR_UNKNOWN;
         return -1;
@@ -159,11 +192,8 @@ int SerialPortLinux::ReadByte() {
         return -1;
     }
 
-    uint8_t buf[1];
-    if (read(serial_fd_, (char*)buf, 1) > 0) {
-        return (int)buf[0];
-    }
-    return -1;
+    result = read(serial_fd_, buffer, length);
+    return result > 0 ? (int)result : -1;
 }
 
 int SerialPortLinux::Write(uint8_t* buffer, int length) {
@@ -174,19 +204,76 @@ int SerialPortLinux::Write(uint8_t* buffer, int length) {
         return -1;
     }
 
-    ssize_t result = write(serial_fd_, buffer, length);
-    if (result < 0) {
-        if (errno == EIO) {
-            last_error_ = SERIAL_PORT_ERROR_IO_FAILED;
-        } else {
-            last_error_ = SERIAL_PORT_ERROR_UNKNOWN;
+    // the port is non-blocking, wait until the driver takes the rest of buffer
+    int written = 0;
+    while (written < length) {
+        ssize_t result = write(serial_fd_, buffer + written, length - written);
+        if (result > 0) {
+            written += (int)result;
+            continue;
+        }
+
+        if (result < 0 && errno != EAGAIN && errno != EINTR) {
+            if (errno == EIO) {
+                last_error_ = SERIAL_PORT_ERROR_IO_FAILED;
+            } else {
+                last_error_ = SERIAL_PORT_ERROR_UNKNOWN;
+            }
+            return written ? written : -1;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = serial_fd_;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, 1000);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+            last_error_ = ret > 0 ? SERIAL_PORT_ERROR_IO_FAILED : SERIAL_PORT_ERROR_UNKNOWN;
+            return written ? written : -1;
         }
-        return -1;
     }
 
     // tcdrain(serial_fd_);
 
-    return result;
+    return written;
+}
+
+int SerialPortLinux::OutputQueue() {
+    int queued = 0;
+    if (!is_open_ || ioctl(serial_fd_, TIOCOUTQ, &queued) < 0) {
+        return 0;
+    }
+    return queued;
+}
+
+bool SerialPortLinux::SetRs485(bool enable, int delay_before, int delay_after) {
+    bool changed = rs485_ || enable;
+    rs485_ = enable;
+    rs485_delay_before_ = delay_before;
+    rs485_delay_after_ = delay_after;
+    if (!is_open_ || !changed) {
+        return true;
+    }
+    return ApplyRs485();
+}
+
+bool SerialPortLinux::ApplyRs485() {
+    struct serial_rs485 rs485;
+    memset(&rs485, 0, sizeof(rs485));
+    if (rs485_) {
+        // RTS is high while sending and low after, so that the transceiver listens to the bus
+        rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+        rs485.delay_rts_before_send = rs485_delay_before_;
+        rs485.delay_rts_after_send = rs485_delay_after_;
+    }
+    if (ioctl(serial_fd_, TIOCSRS485, &rs485) < 0) {
+        last_error_ = SERIAL_PORT_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+    return true;
 }
 
 void SerialPortLinux::SetTimeout(int timeout) {
@@ -17,6 +17,9 @@ class SerialPortLinux : public SerialPortBase {
                     char parity,
                     uint8_t stop_bits) : SerialPortBase(interface_name, baud_rate, data_bits, parity, stop_bits) {
         serial_fd_ = -1;
+        rs485_ = false;
+        rs485_delay_before_ = 0;
+        rs485_delay_after_ = 0;
         read_timeout_.tv_sec = 0;
         read_timeout_.tv_usec = 100000; /* 100 ms */
     }
@@ -33,12 +36,24 @@ class SerialPortLinux : public SerialPortBase {
 
     virtual int ReadByte();
 
+    virtual int Read(uint8_t* buffer, int length);
+
     virtual int Write(uint8_t* buffer, int length);
 
+    virtual int OutputQueue();
+
+    virtual bool SetRs485(bool enable, int delay_before, int delay_after);
+
     virtual void SetTimeout(int timeout);
 
    private:
+    bool ApplyRs485();
+
+   protected:
     int serial_fd_;
+    bool rs485_;
+    int rs485_delay_before_;
+    int rs485_delay_after_;
     struct timeval read_timeout_;
 };
 
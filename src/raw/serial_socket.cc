@@ -0,0 +1,227 @@
+#include "serial_socket.h"
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace raw {
+
+#define SOCKET_BUFFER_SIZE 0x100000
+
+SerialPortSocket::SerialPortSocket(const char* address, bool listen)
+    : SerialPortBase(address, 0, 8, 'N', 1), socket_(-1), listener_(-1), listen_(listen), tcp_(false), read_timeout_(100) {
+}
+
+SerialPortSocket::~SerialPortSocket() {
+    if (is_open_) Close();
+    if (listener_ != -1) {
+        close(listener_);
+        if (!tcp_) {
+            unlink(interface_name_.c_str() + strlen("unix:"));
+        }
+    }
+}
+
+bool SerialPortSocket::Resolve(struct sockaddr_storage* address, socklen_t* size) {
+    memset(address, 0, sizeof(*address));
+    if (interface_name_.compare(0, 5, "unix:") == 0) {
+        std::string path = interface_name_.substr(5);
+        struct sockaddr_un* unix_address = (struct sockaddr_un*)address;
+        if (path.empty() || path.size() >= sizeof(unix_address->sun_path)) {
+            return false;
+        }
+        unix_address->sun_family = AF_UNIX;
+        memcpy(unix_address->sun_path, path.c_str(), path.size());
+        *size = sizeof(struct sockaddr_un);
+        tcp_ = false;
+        return true;
+    }
+
+    size_t colon = interface_name_.rfind(':');
+    if (interface_name_.compare(0, 4, "tcp:") != 0 || colon < 4) {
+        return false;
+    }
+    std::string host = interface_name_.substr(4, colon - 4);
+    std::string port = interface_name_.substr(colon + 1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listen_ ? AI_PASSIVE : 0;
+    struct addrinfo* result = NULL;
+    if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+        return false;
+    }
+    memcpy(address, result->ai_addr, result->ai_addrlen);
+    *size = result->ai_addrlen;
+    freeaddrinfo(result);
+    tcp_ = true;
+    return true;
+}
+
+void SerialPortSocket::Setup(int fd) {
+    // the frames are written whole, they are sended at once instead of being held for more bytes
+    int one = 1;
+    if (tcp_) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    int size = SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+bool SerialPortSocket::Open() {
+    struct sockaddr_storage address;
+    socklen_t size;
+    if (!Resolve(&address, &size)) {
+        last_error_ = SERIAL_PORT_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+
+    if (!listen_) {
+        socket_ = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket_ == -1 || connect(socket_, (struct sockaddr*)&address, size) < 0) {
+            if (socket_ != -1) {
+                close(socket_);
+                socket_ = -1;
+            }
+            last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+            return false;
+        }
+        Setup(socket_);
+        last_error_ = SERIAL_PORT_ERROR_NONE;
+        return is_open_ = true;
+    }
+
+    if (listener_ == -1) {
+        listener_ = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!tcp_) {
+            unlink(((struct sockaddr_un*)&address)->sun_path);
+        }
+        if (listener_ == -1 || bind(listener_, (struct sockaddr*)&address, size) < 0 || listen(listener_, 1) < 0) {
+            if (listener_ != -1) {
+                close(listener_);
+                listener_ = -1;
+            }
+            last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+            return false;
+        }
+    }
+
+    struct pollfd pfd = {listener_, POLLIN, 0};
+    if (poll(&pfd, 1, read_timeout_) <= 0) {
+        last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+        return false;
+    }
+    socket_ = accept4(listener_, NULL, NULL, SOCK_CLOEXEC);
+    if (socket_ == -1) {
+        last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+        return false;
+    }
+    Setup(socket_);
+    last_error_ = SERIAL_PORT_ERROR_NONE;
+    return is_open_ = true;
+}
+
+void SerialPortSocket::Close() {
+    if (socket_ != -1) {
+        close(socket_);
+        socket_ = -1;
+    }
+    is_open_ = false;
+}
+
+void SerialPortSocket::Lost() {
+    last_error_ = SERIAL_PORT_ERROR_IO_FAILED;
+    Close();
+}
+
+void SerialPortSocket::Discard() {
+    uint8_t buffer[256];
+    while (socket_ != -1 && recv(socket_, buffer, sizeof(buffer), 0) > 0) {
+        ;
+    }
+}
+
+int SerialPortSocket::ReadByte() {
+    uint8_t buf[1];
+    if (Read(buf, 1) == 1) {
+        return (int)buf[0];
+    }
+    return -1;
+}
+
+int SerialPortSocket::Read(uint8_t* buffer, int length) {
+    last_error_ = SERIAL_PORT_ERROR_NONE;
+    if (!is_open_) {
+        last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+        return -1;
+    }
+
+    ssize_t result = recv(socket_, buffer, length, 0);
+    if (result < 0 && (errno == EAGAIN || errno == EINTR)) {
+        struct pollfd pfd = {socket_, POLLIN, 0};
+        if (poll(&pfd, 1, read_timeout_) <= 0) {
+            return -1;
+        }
+        result = recv(socket_, buffer, length, 0);
+    }
+    if (result > 0) {
+        return (int)result;
+    }
+    // the peer is gone when the socket ends, the port is opened again by the next read
+    if (result == 0 || (errno != EAGAIN && errno != EINTR)) {
+        Lost();
+    }
+    return -1;
+}
+
+int SerialPortSocket::Write(uint8_t* buffer, int length) {
+    last_error_ = SERIAL_PORT_ERROR_NONE;
+    if (!is_open_) {
+        last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+        return -1;
+    }
+
+    int written = 0;
+    while (written < length) {
+        ssize_t result = send(socket_, buffer + written, length - written, MSG_NOSIGNAL);
+        if (result > 0) {
+            written += (int)result;
+            continue;
+        }
+        if (result < 0 && errno != EAGAIN && errno != EINTR) {
+            Lost();
+            return written ? written : -1;
+        }
+
+        struct pollfd pfd = {socket_, POLLOUT, 0};
+        int ret = poll(&pfd, 1, 1000);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+            last_error_ = ret > 0 ? SERIAL_PORT_ERROR_IO_FAILED : SERIAL_PORT_ERROR_UNKNOWN;
+            return written ? written : -1;
+        }
+    }
+    return written;
+}
+
+void SerialPortSocket::SetTimeout(int timeout) {
+    read_timeout_ = timeout;
+}
+
+}  // namespace raw
+#endif
@@ -0,0 +1,59 @@
+#ifndef _SERIAL_SOCKET_H
+#define _SERIAL_SOCKET_H
+#ifdef __linux__
+
+#include <sys/socket.h>
+
+#include "serial_base.h"
+
+namespace raw {
+
+/// @brief Serial port carried by a stream socket, for terminal servers and links between local processes
+/// NOTE: The address is "unix:<path>" or "tcp:<host>:<port>". The listening side takes one peer at a
+/// time, a peer lost closes the port and the next open waits for another one.
+class SerialPortSocket : public SerialPortBase {
+   public:
+    /// @param address the address of socket
+    /// @param listen whether to wait for the peer to connect instead of connecting to it
+    SerialPortSocket(const char* address, bool listen);
+
+    virtual ~SerialPortSocket();
+
+    /// NOTE: the listening side waits for the peer up to the read timeout
+    virtual bool Open();
+
+    virtual void Close();
+
+    virtual void Discard();
+
+    virtual int ReadByte();
+
+    virtual int Read(uint8_t* buffer, int length);
+
+    virtual int Write(uint8_t* buffer, int length);
+
+    virtual void SetTimeout(int timeout);
+
+   private:
+    /// @brief Get the socket address from the address of port
+    /// @return true in case of success, false if the address is malformed or unknown
+    bool Resolve(struct sockaddr_storage* address, socklen_t* size);
+
+    /// @brief Set the options of a connected socket
+    void Setup(int fd);
+
+    /// @brief Close the socket after the peer is lost
+    void Lost();
+
+   private:
+    int socket_;
+    int listener_;
+    bool listen_;
+    bool tcp_;
+    int read_timeout_;  // ms
+};
+
+}  // namespace raw
+
+#endif
+#endif
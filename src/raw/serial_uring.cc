@@ -0,0 +1,463 @@
+#include "serial_uring.h"
+#ifdef __linux__
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "log/log.h"
+
+namespace raw {
+
+#define PORT_BUFFER_SIZE 4096
+
+static uint64_t GetTimeInMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+UringContext::UringContext(int ports, int buffer_size)
+    : ring_fd_(-1),
+      sq_memory_(MAP_FAILED),
+      sq_memory_size_(0),
+      cq_memory_(MAP_FAILED),
+      cq_memory_size_(0),
+      sqes_((io_uring_sqe*)MAP_FAILED),
+      sqes_size_(0),
+      queued_(0),
+      fixed_(false),
+      buffer_size_(buffer_size),
+      buffers_((size_t)ports * buffer_size),
+      used_(ports, false),
+      reaping_(false) {
+    // a read and a write of each port, both led by a poll, and the cancels
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, ports * 4 + 4, &params);
+    if (fd < 0) {
+        qInfo << "io_uring not supported, serial ports fall back to select! " << strerror(errno);
+        return;
+    }
+    // the wait of ports has a timeout
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        qInfo << "io_uring too old, serial ports fall back to select!";
+        close(fd);
+        return;
+    }
+
+    sq_memory_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_memory_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        sq_memory_size_ = cq_memory_size_ = std::max(sq_memory_size_, cq_memory_size_);
+    }
+    sq_memory_ = mmap(NULL, sq_memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (single) {
+        cq_memory_ = sq_memory_;
+    } else if (sq_memory_ != MAP_FAILED) {
+        cq_memory_ = mmap(NULL, cq_memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (cq_memory_ != MAP_FAILED) {
+        sqes_ = (io_uring_sqe*)mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    if (sqes_ == MAP_FAILED) {
+        qWarning << "map io_uring failed! " << strerror(errno);
+        if (cq_memory_ != MAP_FAILED && cq_memory_ != sq_memory_) {
+            munmap(cq_memory_, cq_memory_size_);
+        }
+        if (sq_memory_ != MAP_FAILED) {
+            munmap(sq_memory_, sq_memory_size_);
+        }
+        close(fd);
+        return;
+    }
+
+    uint8_t* sq = (uint8_t*)sq_memory_;
+    uint8_t* cq = (uint8_t*)cq_memory_;
+    sq_head_ = (unsigned*)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_entries_ = *(unsigned*)(sq + params.sq_off.ring_entries);
+    sq_array_ = (unsigned*)(sq + params.sq_off.array);
+    cq_head_ = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+
+    // the kernel reads into registered buffers without mapping them for every read
+    std::vector<struct iovec> iovs(ports);
+    for (int i = 0; i < ports; i++) {
+        iovs[i].iov_base = buffers_.data() + (size_t)i * buffer_size_;
+        iovs[i].iov_len = buffer_size_;
+    }
+    fixed_ = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovs.data(), ports) == 0;
+    if (!fixed_) {
+        qInfo << "register io_uring buffers failed! " << strerror(errno);
+    }
+    ring_fd_ = fd;
+}
+
+UringContext::~UringContext() {
+    if (ring_fd_ < 0) {
+        return;
+    }
+    munmap(sqes_, sqes_size_);
+    if (cq_memory_ != sq_memory_) {
+        munmap(cq_memory_, cq_memory_size_);
+    }
+    munmap(sq_memory_, sq_memory_size_);
+    close(ring_fd_);
+}
+
+int UringContext::Attach(uint8_t** buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < used_.size(); i++) {
+        if (!used_[i]) {
+            used_[i] = true;
+            *buffer = buffers_.data() + i * buffer_size_;
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+void UringContext::Detach(int slot) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_[slot] = false;
+}
+
+io_uring_sqe* UringContext::GetSqe() {
+    unsigned tail = *sq_tail_ + queued_;
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail - head >= sq_entries_) {
+        return NULL;
+    }
+    unsigned index = tail & sq_mask_;
+    sq_array_[index] = index;
+    memset(&sqes_[index], 0, sizeof(struct io_uring_sqe));
+    queued_++;
+    return &sqes_[index];
+}
+
+void UringContext::Publish() {
+    // the linked entries are published together, so that a concurrent submit does not split them
+    __atomic_store_n(sq_tail_, *sq_tail_ + queued_, __ATOMIC_RELEASE);
+    queued_ = 0;
+}
+
+bool UringContext::QueueRead(int fd, int slot, Request* poll, Request* read) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    io_uring_sqe* poll_sqe = GetSqe();
+    io_uring_sqe* read_sqe = GetSqe();
+    if (!poll_sqe || !read_sqe) {
+        queued_ = 0;
+        return false;
+    }
+
+    // the tty returns no bytes at once instead of waiting for them, the read is started by the poll
+    poll_sqe->opcode = IORING_OP_POLL_ADD;
+    poll_sqe->fd = fd;
+    poll_sqe->poll32_events = POLLIN;
+    poll_sqe->flags = IOSQE_IO_LINK;
+    poll_sqe->user_data = (uint64_t)(uintptr_t)poll;
+
+    read_sqe->opcode = fixed_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    read_sqe->fd = fd;
+    read_sqe->off = (uint64_t)-1;
+    read_sqe->addr = (uint64_t)(uintptr_t)(buffers_.data() + (size_t)slot * buffer_size_);
+    read_sqe->len = buffer_size_;
+    read_sqe->buf_index = fixed_ ? slot : 0;
+    read_sqe->user_data = (uint64_t)(uintptr_t)read;
+
+    poll->done = read->done = false;
+    Publish();
+    return true;
+}
+
+bool UringContext::QueueWrite(int fd, uint8_t* buffer, int length, bool wait, Request* poll, Request* write) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    io_uring_sqe* poll_sqe = wait ? GetSqe() : NULL;
+    io_uring_sqe* write_sqe = GetSqe();
+    if ((wait && !poll_sqe) || !write_sqe) {
+        queued_ = 0;
+        return false;
+    }
+
+    if (poll_sqe) {
+        poll_sqe->opcode = IORING_OP_POLL_ADD;
+        poll_sqe->fd = fd;
+        poll_sqe->poll32_events = POLLOUT;
+        poll_sqe->flags = IOSQE_IO_LINK;
+        poll_sqe->user_data = (uint64_t)(uintptr_t)poll;
+        poll->done = false;
+    }
+
+    write_sqe->opcode = IORING_OP_WRITE;
+    write_sqe->fd = fd;
+    write_sqe->off = (uint64_t)-1;
+    write_sqe->addr = (uint64_t)(uintptr_t)buffer;
+    write_sqe->len = length;
+    write_sqe->user_data = (uint64_t)(uintptr_t)write;
+    write->done = false;
+    Publish();
+    return true;
+}
+
+void UringContext::Cancel(Request* request) {
+    unsigned submit;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        io_uring_sqe* sqe = GetSqe();
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)request;
+            Publish();
+        }
+        submit = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+    Enter(submit, 0, 0);
+}
+
+bool UringContext::Wait(Request* request, int timeout) {
+    uint64_t deadline = GetTimeInMs() + (timeout > 0 ? timeout : 0);
+    bool waited = false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!request->done) {
+        int left = -1;
+        if (timeout >= 0) {
+            uint64_t now = GetTimeInMs();
+            if (waited && now >= deadline) {
+                return false;
+            }
+            left = now < deadline ? (int)(deadline - now) : 0;
+        }
+        waited = true;
+
+        unsigned submit = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (reaping_) {
+            // the thread on the ring takes our completion, the entries queued are submitted by us
+            if (submit) {
+                lock.unlock();
+                Enter(submit, 0, 0);
+                lock.lock();
+            }
+            if (request->done) {
+                break;
+            }
+            waiting_.push_back(request);
+            if (left < 0) {
+                request->completed.wait(lock);
+            } else {
+                request->completed.wait_for(lock, std::chrono::milliseconds(left));
+            }
+            waiting_.erase(std::find(waiting_.begin(), waiting_.end(), request));
+            continue;
+        }
+
+        reaping_ = true;
+        lock.unlock();
+        if (Enter(submit, 1, left) < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            qWarning << "io_uring enter failed! " << strerror(errno);
+        }
+        lock.lock();
+        Reap();
+        reaping_ = false;
+        // a thread still waiting takes over the ring
+        for (size_t i = 0; i < waiting_.size(); i++) {
+            if (!waiting_[i]->done) {
+                waiting_[i]->completed.notify_one();
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+int UringContext::Enter(unsigned submit, unsigned wait, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = 0;
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    return (int)syscall(__NR_io_uring_enter, ring_fd_, submit, wait, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+}
+
+void UringContext::Reap() {
+    struct io_uring_cqe* cqes = (struct io_uring_cqe*)cqes_;
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &cqes[head & cq_mask_];
+        Request* request = (Request*)(uintptr_t)cqe->user_data;
+        if (request) {
+            request->result = cqe->res;
+            request->done = true;
+            request->completed.notify_one();
+        }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+SerialPortUring::SerialPortUring(UringContext* context, const char* interface_name, int baud_rate,
+                                 uint8_t data_bits,
+                                 char parity,
+                                 uint8_t stop_bits) : SerialPortLinux(interface_name, baud_rate, data_bits, parity, stop_bits),
+                                                      context_(context),
+                                                      slot_(-1),
+                                                      buffer_(NULL),
+                                                      staged_begin_(0),
+                                                      staged_end_(0),
+                                                      reading_(false) {
+    if (!context_) {
+        owned_context_.reset(new UringContext(1, PORT_BUFFER_SIZE));
+        context_ = owned_context_.get();
+    }
+}
+
+SerialPortUring::~SerialPortUring() {
+    if (is_open_) Close();
+}
+
+bool SerialPortUring::Open() {
+    if (!SerialPortLinux::Open()) {
+        return false;
+    }
+    if (context_->is_valid()) {
+        slot_ = context_->Attach(&buffer_);
+    }
+    staged_begin_ = staged_end_ = 0;
+    return true;
+}
+
+void SerialPortUring::Close() {
+    // the read in flight writes to the buffer of port, it ends before the buffer is given back
+    if (reading_) {
+        Complete(&read_poll_, &read_, 0);
+        reading_ = false;
+    }
+    if (slot_ >= 0) {
+        context_->Detach(slot_);
+        slot_ = -1;
+    }
+    SerialPortLinux::Close();
+}
+
+void SerialPortUring::Discard() {
+    SerialPortLinux::Discard();
+    staged_begin_ = staged_end_ = 0;
+}
+
+int SerialPortUring::Read(uint8_t* buffer, int length) {
+    if (slot_ < 0) {
+        return SerialPortLinux::Read(buffer, length);
+    }
+
+    last_error_ = SERIAL_PORT_ERROR_NONE;
+    if (!is_open_) {
+        last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+        return -1;
+    }
+    if (length <= 0) {
+        return -1;
+    }
+
+    int timeout = (int)(read_timeout_.tv_sec * 1000 + read_timeout_.tv_usec / 1000);
+    uint64_t deadline = GetTimeInMs() + timeout;
+    while (staged_begin_ == staged_end_) {
+        if (!reading_) {
+            if (!context_->QueueRead(serial_fd_, slot_, &read_poll_, &read_)) {
+                return SerialPortLinux::Read(buffer, length);
+            }
+            reading_ = true;
+        }
+
+        // the read stays in flight after a timeout and takes the bytes arriving later
+        uint64_t now = GetTimeInMs();
+        if (!context_->Wait(&read_, now < deadline ? (int)(deadline - now) : 0)) {
+            return -1;
+        }
+        reading_ = false;
+        if (read_.result > 0) {
+            staged_begin_ = 0;
+            staged_end_ = read_.result;
+            break;
+        }
+        if (read_.result == 0) {
+            return -1;
+        }
+        if (read_.result != -EAGAIN && read_.result != -EINTR) {
+            last_error_ = read_.result == -EIO ? SERIAL_PORT_ERROR_IO_FAILED : SERIAL_PORT_ERROR_UNKNOWN;
+            return -1;
+        }
+    }
+
+    int bytes = std::min(length, staged_end_ - staged_begin_);
+    memcpy(buffer, buffer_ + staged_begin_, bytes);
+    staged_begin_ += bytes;
+    // the next read is queued at once and goes to the kernel with the next submission of any port
+    if (staged_begin_ == staged_end_ && context_->QueueRead(serial_fd_, slot_, &read_poll_, &read_)) {
+        reading_ = true;
+    }
+    return bytes;
+}
+
+int SerialPortUring::Write(uint8_t* buffer, int length) {
+    if (slot_ < 0) {
+        return SerialPortLinux::Write(buffer, length);
+    }
+
+    last_error_ = SERIAL_PORT_ERROR_NONE;
+    if (!is_open_) {
+        last_error_ = SERIAL_PORT_ERROR_OPEN_FAILED;
+        return -1;
+    }
+
+    int written = 0;
+    bool wait = false;
+    while (written < length) {
+        if (!context_->QueueWrite(serial_fd_, buffer + written, length - written, wait, &write_poll_, &write_)) {
+            int result = SerialPortLinux::Write(buffer + written, length - written);
+            return result < 0 ? (written ? written : -1) : written + result;
+        }
+
+        // the kernel writes from the buffer of caller, the write ends before we return
+        Complete(wait ? &write_poll_ : &write_, &write_, 1000);
+        if (write_.result > 0) {
+            written += write_.result;
+            wait = false;
+        } else if (write_.result == -EAGAIN || write_.result == -EINTR) {
+            wait = true;
+        } else {
+            last_error_ = write_.result == -EIO ? SERIAL_PORT_ERROR_IO_FAILED : SERIAL_PORT_ERROR_UNKNOWN;
+            return written ? written : -1;
+        }
+    }
+    return written;
+}
+
+void SerialPortUring::Complete(UringContext::Request* poll, UringContext::Request* request, int timeout) {
+    if (!context_->Wait(request, timeout)) {
+        context_->Cancel(poll);
+        context_->Wait(request, -1);
+    }
+}
+
+}  // namespace raw
+#endif
@@ -0,0 +1,147 @@
+#ifndef _SERIAL_URING_H
+#define _SERIAL_URING_H
+#ifdef __linux__
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "serial_linux.h"
+
+struct io_uring_sqe;
+
+namespace raw {
+
+/// @brief io_uring shared by the serial ports of a process
+/// NOTE: The submissions of all ports are queued to one ring and go to the kernel with the next wait
+/// of any port, so that a port waiting for its read submits the writes and reads queued by the others
+/// in the same syscall. The thread waiting on the ring takes the completions of all ports and wakes
+/// their threads, only the thread of a completed request is woken. That is a second wakeup for the
+/// ports having their own threads, as the master does, so that such ports do better with a context each.
+class UringContext {
+   public:
+    /// @param ports the number of ports served, each gets a registered buffer
+    /// @param buffer_size size of the buffer of each port
+    UringContext(int ports, int buffer_size);
+    ~UringContext();
+
+    /// @brief Get whether the kernel supports the ring
+    /// NOTE: the ports fall back to SerialPortLinux if not
+    /// @return
+    bool is_valid() { return ring_fd_ >= 0; }
+
+   private:
+    friend class SerialPortUring;
+
+    struct Request {
+        int result;  // result of the operation, negative errno on failure
+        bool done;
+        std::condition_variable completed;  // notified when done or the thread has to wait on the ring
+    };
+
+    /// @brief Take a free buffer for a port
+    /// @param buffer the buffer
+    /// @return index of the buffer, -1 if none is free
+    int Attach(uint8_t** buffer);
+
+    /// @brief Give back the buffer of a port
+    /// @param slot index of the buffer
+    void Detach(int slot);
+
+    /// @brief Queue a read of fd into the buffer of port once fd is readable
+    bool QueueRead(int fd, int slot, Request* poll, Request* read);
+
+    /// @brief Queue a write of fd, after fd is writable if wait is set
+    bool QueueWrite(int fd, uint8_t* buffer, int length, bool wait, Request* poll, Request* write);
+
+    /// @brief Queue the cancel of the request and submit it
+    void Cancel(Request* request);
+
+    /// @brief Submit the queued requests and wait for the request to complete
+    /// @param request the request
+    /// @param timeout the time to wait in ms, -1 to wait forever
+    /// @return true if the request is completed
+    bool Wait(Request* request, int timeout);
+
+   private:
+    io_uring_sqe* GetSqe();
+    void Publish();
+    int Enter(unsigned submit, unsigned wait, int timeout);
+    void Reap();
+
+   private:
+    int ring_fd_;
+    void* sq_memory_;
+    size_t sq_memory_size_;
+    void* cq_memory_;
+    size_t cq_memory_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* sq_array_;
+    unsigned queued_;  // entries filled and not yet published
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    void* cqes_;
+
+    bool fixed_;  // whether the buffers are registered
+    int buffer_size_;
+    std::vector<uint8_t> buffers_;
+    std::vector<bool> used_;
+
+    std::mutex mutex_;
+    bool reaping_;                    // whether a thread waits on the ring
+    std::vector<Request*> waiting_;  // requests whose threads wait for the thread on the ring
+};
+
+/// @brief Serial port doing its io by a ring shared with other ports
+/// NOTE: A read is kept in flight into the buffer of port and the bytes are taken from there, so that a
+/// wakeup costs one syscall shared by the ports instead of a select and a read per port.
+class SerialPortUring : public SerialPortLinux {
+   public:
+    /// @param context the ring shared with other ports, NULL for a ring of the port only. The port works as
+    /// SerialPortLinux if it is not valid.
+    SerialPortUring(UringContext* context, const char* interface_name, int baud_rate,
+                    uint8_t data_bits,
+                    char parity,
+                    uint8_t stop_bits);
+
+    virtual ~SerialPortUring();
+
+    virtual bool Open();
+
+    virtual void Close();
+
+    virtual void Discard();
+
+    virtual int Read(uint8_t* buffer, int length);
+
+    virtual int Write(uint8_t* buffer, int length);
+
+   private:
+    /// @brief Wait until the request completes, it is cancelled on timeout
+    void Complete(UringContext::Request* poll, UringContext::Request* request, int timeout);
+
+   private:
+    UringContext* context_;
+    std::unique_ptr<UringContext> owned_context_;
+    int slot_;  // buffer in the context, -1 if the port falls back to SerialPortLinux
+    uint8_t* buffer_;
+    int staged_begin_;  // bytes read into buffer and not yet taken
+    int staged_end_;
+    bool reading_;  // whether a read is in flight
+    UringContext::Request read_poll_;
+    UringContext::Request read_;
+    UringContext::Request write_poll_;
+    UringContext::Request write_;
+};
+
+}  // namespace raw
+
+#endif
+#endif
@@ -77,6 +77,11 @@ bool SerialPortWin::Open() {
     else /* 'O' */
         serialParams->Parity = ODDPARITY;
 
+    /* RTS is high while sending for RS-485 transceiver, the delays are not supported */
+    if (rs485_) {
+        serialParams->fRtsControl = RTS_CONTROL_TOGGLE;
+    }
+
     status = SetCommState(serial_handle_, serialParams);
     if (status == false) {
         last_error_ = SERIAL_PORT_ERROR_INVALID_ARGUMENT;
@@ -155,29 +160,67 @@ int SerialPortWin::Write(uint8_t* buffer, int length) {
         return -1;
     }
 
-    DWORD numberOfBytesWritten = 0;
-    BOOL status = WriteFile(serial_handle_, buffer, length, &numberOfBytesWritten, NULL);
-    if (status == false) {
-        switch (::GetLastError()) {
-            case ERROR_BAD_COMMAND:
-                last_error_ = SERIAL_PORT_ERROR_IO_FAILED;
-                break;
-            case ERROR_SEM_TIMEOUT:
-                break;
-            default:
-                last_error_ = SERIAL_PORT_ERROR_UNKNOWN;
-                break;
+    // a write timed out returns the bytes taken so far, go on with the rest of buffer
+    int written = 0;
+    while (written < length) {
+        DWORD numberOfBytesWritten = 0;
+        BOOL status = WriteFile(serial_handle_, buffer + written, length - written, &numberOfBytesWritten, NULL);
+        if (status == false) {
+            switch (::GetLastError()) {
+                case ERROR_BAD_COMMAND:
+                    last_error_ = SERIAL_PORT_ERROR_IO_FAILED;
+                    break;
+                case ERROR_SEM_TIMEOUT:
+                    break;
+                default:
+                    last_error_ = SERIAL_PORT_ERROR_UNKNOWN;
+                    break;
+            }
+            return written ? written : -1;
         }
-        return -1;
+        if (numberOfBytesWritten == 0) {
+            last_error_ = SERIAL_PORT_ERROR_UNKNOWN;
+            return written ? written : -1;
+        }
+        written += (int)numberOfBytesWritten;
     }
 
-    status = FlushFileBuffers(serial_handle_);
+    BOOL status = FlushFileBuffers(serial_handle_);
 
     if (status == false) {
         ;
     }
 
-    return (int)numberOfBytesWritten;
+    return written;
+}
+
+int SerialPortWin::OutputQueue() {
+    DWORD errors = 0;
+    COMSTAT status = {0};
+    if (!is_open_ || !ClearCommError(serial_handle_, &errors, &status)) {
+        return 0;
+    }
+    return (int)status.cbOutQue;
+}
+
+bool SerialPortWin::SetRs485(bool enable, int /* delay_before */, int /* delay_after */) {
+    rs485_ = enable;
+    if (!is_open_) {
+        return true;
+    }
+
+    DCB serial_params = {0};
+    serial_params.DCBlength = sizeof(DCB);
+    if (!GetCommState(serial_handle_, &serial_params)) {
+        last_error_ = SERIAL_PORT_ERROR_UNKNOWN;
+        return false;
+    }
+    serial_params.fRtsControl = rs485_ ? RTS_CONTROL_TOGGLE : RTS_CONTROL_ENABLE;
+    if (!SetCommState(serial_handle_, &serial_params)) {
+        last_error_ = SERIAL_PORT_ERROR_INVALID_ARGUMENT;
+        return false;
+    }
+    return true;
 }
 
 void SerialPortWin::SetTimeout(int timeout) {
@@ -13,6 +13,7 @@ class SerialPortWin : public SerialPortBase {
         : SerialPortBase(interface_name, baud_rate, data_bits, parity, stop_bits) {
         serial_handle_ = INVALID_HANDLE_VALUE;
         read_timeout_ = 100;
+        rs485_ = false;
     }
 
     virtual ~SerialPortWin() {
@@ -29,11 +30,16 @@ class SerialPortWin : public SerialPortBase {
 
     virtual int Write(uint8_t* buffer, int length);
 
+    virtual int OutputQueue();
+
+    virtual bool SetRs485(bool enable, int delay_before, int delay_after);
+
     virtual void SetTimeout(int timeout);
 
    private:
     HANDLE serial_handle_;
     int read_timeout_;
+    bool rs485_;
 };
 
 }  // namespace raw
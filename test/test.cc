@@ -156,7 +156,10 @@ int main(int argc, char** argvs) {
         // 清除缓存
         serial.Discard();
         // 主从站实例
-        protocol::Master master(&serial, {5, 8});
+        protocol::APCIParameters parameters = {};
+        parameters.time_alive = 5;
+        parameters.time_heart = 8;
+        protocol::Master master(&serial, parameters);
         g_master_ = &master;
         // 绑定接收回调
         master.SetRecviverHandler(ReceivedHandler);